@@ -0,0 +1,896 @@
+// Credential broker for purple-gnome-keyring
+//
+// Several libpurple instances of one user would each search the same
+// keyring. The broker holds one keyring session and an index of the items
+// of the plugin, and serves every plugin instance on a private socket. It also
+// migrates legacy items and probes an unresponsive keyring for all of them.
+//
+// Usage: purple-gnome-keyring-broker [--socket PATH] [--session]
+// With --session it serves on the session bus instead, e.g. for testing with
+//     gdbus call --session --dest im.pidgin.purple.GnomeKeyringBroker
+//         --object-path /im/pidgin/purple/GnomeKeyringBroker
+//         --method im.pidgin.purple.GnomeKeyringBroker.Lookup
+//         /org/freedesktop/secrets/collection/login prpl-jabber user@example.org
+
+#define G_LOG_DOMAIN "purple-gnome-keyring-broker"
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <string.h>
+
+#include "purple-gnome-keyring.h"
+
+#define SECRET_COLLECTION_INTERFACE "org.freedesktop.Secret.Collection"
+#define BROKER_PROBE_CACHE          (5 * G_USEC_PER_SEC)    // Probe result shared by all instances
+#define BROKER_PROBE_TIMEOUT        10                      // Seconds
+
+static const gchar broker_introspection_xml[] =
+    "<node>"
+    "  <interface name='" BROKER_INTERFACE "'>"
+    "    <method name='Lookup'>"
+    "      <arg type='s' name='collection' direction='in'/>"
+    "      <arg type='s' name='protocol' direction='in'/>"
+    "      <arg type='s' name='username' direction='in'/>"
+    "      <arg type='u' name='status' direction='out'/>"
+    "      <arg type='o' name='item' direction='out'/>"
+    "    </method>"
+    "    <method name='Ping'>"
+    "      <arg type='b' name='responsive' direction='out'/>"
+    "    </method>"
+    "  </interface>"
+    "</node>";
+
+// Index state of a keyring
+typedef enum {INDEX_NONE = 0, INDEX_BUILDING = 1, INDEX_READY = 2} index_state;
+
+// Keyring and the items of the plugin it holds
+typedef struct {
+    SecretCollection* collection;
+    GHashTable* index;              // "protocol\nusername" -> GPtrArray of SecretItems, duplicates included
+    GHashTable* keys;               // Item path -> index key, for items of the plugin only
+    index_state state;
+    GHashTable* changed;            // Item paths signalled while the index is built
+    gboolean migrated;              // No legacy items left
+    gboolean migration_failed;
+    guint migrating;                // Legacy items being rewritten
+    GCancellable* cancellable;      // Cancelled once the keyring is gone
+    guint items_subscription;
+    gulong locked_handler;
+} BrokerCollection;
+
+// Single item loaded after a signal
+typedef struct {
+    BrokerCollection* bc;
+    gchar* path;
+} ItemLoad;
+
+SecretService* broker_service           = NULL;
+GHashTable* broker_collections          = NULL;     // Object path -> BrokerCollection
+GDBusNodeInfo* broker_introspection     = NULL;
+GMainLoop* broker_loop                  = NULL;
+gchar* broker_socket                    = NULL;     // Unlinked on exit, NULL on the session bus
+guint broker_lookups                    = 0;
+guint broker_searches                   = 0;
+guint broker_item_loads                 = 0;
+GList* broker_pings                     = NULL;     // Ping invocations waiting for the running probe
+GCancellable* broker_probe              = NULL;     // Running keyring probe
+guint broker_probe_timeout              = 0;
+gboolean broker_responsive              = FALSE;
+gint64 broker_probed                    = 0;        // Monotonic time of the last probe
+
+/**************************************************
+ **************************************************
+ ***************** Item index *********************
+ **************************************************
+ **************************************************/
+
+static gchar* index_key(const gchar* protocol, const gchar* username)
+{
+    return g_strdup_printf("%s\n%s", protocol, username);
+}
+
+static void index_remove(BrokerCollection* bc, const gchar* path)
+{
+    const gchar* key = g_hash_table_lookup(bc->keys, path);
+    if(key == NULL) return;
+
+    GPtrArray* items = g_hash_table_lookup(bc->index, key);
+
+    for(guint i = 0; i < items->len; i++)
+    {
+        if(strcmp(g_dbus_proxy_get_object_path(G_DBUS_PROXY(g_ptr_array_index(items, i))), path) == 0)
+        {
+            g_ptr_array_remove_index_fast(items, i);
+            break;
+        }
+    }
+
+    if(items->len == 0) g_hash_table_remove(bc->index, key);
+    g_hash_table_remove(bc->keys, path);
+}
+
+// Replaces an indexed copy of the item. Items of other applications share the
+// keyring, only items of the plugin are indexed.
+static void index_add(BrokerCollection* bc, SecretItem* item)
+{
+    const gchar* path       = g_dbus_proxy_get_object_path(G_DBUS_PROXY(item));
+    GHashTable* attrs       = secret_item_get_attributes(item);
+    const gchar* program    = g_hash_table_lookup(attrs, "program");
+    const gchar* protocol   = g_hash_table_lookup(attrs, "protocol");
+    const gchar* username   = g_hash_table_lookup(attrs, "username");
+
+    index_remove(bc, path);
+
+    if((g_strcmp0(program, SCHEMA_PROGRAM) == 0) && (protocol != NULL) && (username != NULL))
+    {
+        gchar* key          = index_key(protocol, username);
+        GPtrArray* items    = g_hash_table_lookup(bc->index, key);
+
+        if(items == NULL)
+        {
+            items = g_ptr_array_new_with_free_func(g_object_unref);
+            g_hash_table_insert(bc->index, g_strdup(key), items);
+        }
+
+        g_ptr_array_add(items, g_object_ref(item));
+        g_hash_table_insert(bc->keys, g_strdup(path), key);
+    }
+
+    g_hash_table_unref(attrs);
+}
+
+// Duplicates resolve like the plugin does, see item_is_newer
+static SecretItem* index_lookup(BrokerCollection* bc, const gchar* protocol, const gchar* username)
+{
+    gchar* key          = index_key(protocol, username);
+    GPtrArray* items    = g_hash_table_lookup(bc->index, key);
+    SecretItem* newest  = NULL;
+    g_free(key);
+
+    for(guint i = 0; (items != NULL) && (i < items->len); i++)
+    {
+        SecretItem* item = g_ptr_array_index(items, i);
+        if((newest == NULL) || item_is_newer(item, newest)) newest = item;
+    }
+
+    return newest;
+}
+
+static void index_search(BrokerCollection* bc);
+static void migrate_item(BrokerCollection* bc, SecretItem* item);
+
+static void on_item_loaded(GObject* source, GAsyncResult* result, gpointer user_data)
+{
+    ItemLoad* load      = (ItemLoad*) user_data;
+    GError* error       = NULL;
+    SecretItem* item    = secret_item_new_for_dbus_path_finish(result, &error);
+
+    // Keyring is gone, so is load->bc
+    if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        g_error_free(error);
+    }
+    else if(error != NULL)
+    {
+        // Deleted meanwhile
+        g_debug("Could not load item %s: %s", load->path, error->message);
+        g_error_free(error);
+        index_remove(load->bc, load->path);
+    }
+    else
+    {
+        gchar* schema = secret_item_get_schema_name(item);
+
+        if(g_strcmp0(schema, LEGACY_SCHEMA->name) == 0) migrate_item(load->bc, item);
+        else index_add(load->bc, item);
+
+        g_free(schema);
+        g_object_unref(item);
+    }
+
+    g_free(load->path);
+    g_free(load);
+}
+
+// One item proxy per signal instead of searching the whole keyring
+static void index_update(BrokerCollection* bc, const gchar* path)
+{
+    ItemLoad* load  = g_new(ItemLoad, 1);
+    load->bc        = bc;
+    load->path      = g_strdup(path);
+
+    broker_item_loads++;
+    secret_item_new_for_dbus_path(broker_service, path, SECRET_ITEM_NONE, bc->cancellable, on_item_loaded, load);
+}
+
+// ItemCreated, ItemDeleted or ItemChanged
+static void on_items_changed(GDBusConnection* connection,
+                    const gchar* sender,
+                    const gchar* path,
+                    const gchar* interface,
+                    const gchar* signal,
+                    GVariant* parameters,
+                    gpointer user_data)
+{
+    BrokerCollection* bc = (BrokerCollection*) user_data;
+    const gchar* item;
+
+    if(!g_variant_is_of_type(parameters, G_VARIANT_TYPE("(o)"))) return;
+    g_variant_get(parameters, "(&o)", &item);
+
+    // The running search may miss the change, applied once it is done
+    if(bc->state == INDEX_BUILDING)
+        g_hash_table_add(bc->changed, g_strdup(item));
+
+    // Nothing indexed yet, the first build sees the change
+    else if(bc->state == INDEX_NONE)
+        return;
+
+    else if(strcmp(signal, "ItemDeleted") == 0)
+        index_remove(bc, item);
+
+    // The indexed copy is kept until the new one is loaded
+    else
+        index_update(bc, item);
+}
+
+static void on_index_searched(GObject* source, GAsyncResult* result, gpointer user_data)
+{
+    GError* error   = NULL;
+    GList* items    = secret_collection_search_finish(SECRET_COLLECTION(source), result, &error);
+
+    // Keyring is gone, so is user_data
+    if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        g_error_free(error);
+        return;
+    }
+
+    BrokerCollection* bc    = (BrokerCollection*) user_data;
+    const gchar* path       = g_dbus_proxy_get_object_path(G_DBUS_PROXY(bc->collection));
+
+    if(error != NULL)
+    {
+        // Built again on the next lookup
+        g_warning("Could not index keyring %s: %s", path, error->message);
+        g_error_free(error);
+        g_hash_table_remove_all(bc->changed);
+        bc->state = INDEX_NONE;
+        return;
+    }
+
+    g_hash_table_remove_all(bc->index);
+    g_hash_table_remove_all(bc->keys);
+
+    for(GList* li = items; li != NULL; li = li->next) index_add(bc, li->data);
+
+    bc->state = INDEX_READY;
+    g_debug("Indexed %u accounts of keyring %s", g_hash_table_size(bc->index), path);
+    g_list_free_full(items, g_object_unref);
+
+    // Signalled while searching
+    GHashTableIter iter;
+    gpointer changed;
+    g_hash_table_iter_init(&iter, bc->changed);
+
+    while(g_hash_table_iter_next(&iter, &changed, NULL)) index_update(bc, changed);
+    g_hash_table_remove_all(bc->changed);
+}
+
+// One search per keyring, shared by all plugin instances. Afterwards the
+// index follows the item signals.
+static void index_search(BrokerCollection* bc)
+{
+    GHashTable* attributes = g_hash_table_new(g_str_hash, g_str_equal);
+    g_hash_table_insert(attributes, "program", (gpointer*) SCHEMA_PROGRAM);
+
+    broker_searches++;
+    secret_collection_search(bc->collection,
+            PURPLE_SCHEMA,
+            attributes,
+            SECRET_SEARCH_ALL,
+            bc->cancellable,
+            on_index_searched,
+            bc);
+
+    g_hash_table_destroy(attributes);
+}
+
+/**************************************************
+ **************************************************
+ **************** Schema migration ****************
+ **************************************************
+ **************************************************/
+
+// Items of older plugin versions get the program attribute, like the plugin
+// migrates them without a broker. A failed migration is retried once the
+// keyring is unlocked again.
+
+static void migration_done(BrokerCollection* bc)
+{
+    if(--bc->migrating > 0) return;
+
+    bc->migrated = !bc->migration_failed;
+    if(bc->state == INDEX_BUILDING) index_search(bc);
+}
+
+static void on_item_migrated(GObject* source, GAsyncResult* result, gpointer user_data)
+{
+    GError* error = NULL;
+    secret_item_set_attributes_finish(SECRET_ITEM(source), result, &error);
+
+    // Keyring is gone, so is user_data
+    if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        g_error_free(error);
+        return;
+    }
+
+    BrokerCollection* bc = (BrokerCollection*) user_data;
+
+    if(error != NULL)
+    {
+        g_warning("Could not migrate item %s: %s", g_dbus_proxy_get_object_path(G_DBUS_PROXY(source)), error->message);
+        g_error_free(error);
+        bc->migration_failed = TRUE;
+    }
+
+    migration_done(bc);
+}
+
+// The rewrite is signalled as ItemChanged, which indexes the item
+static void migrate_item(BrokerCollection* bc, SecretItem* item)
+{
+    GHashTable* legacy      = secret_item_get_attributes(item);
+    const gchar* protocol   = g_hash_table_lookup(legacy, "protocol");
+    const gchar* username   = g_hash_table_lookup(legacy, "username");
+
+    if((protocol != NULL) && (username != NULL))
+    {
+        GHashTable* attributes = g_hash_table_new(g_str_hash, g_str_equal);
+        g_hash_table_insert(attributes, "program", (gpointer*) SCHEMA_PROGRAM);
+        g_hash_table_insert(attributes, "protocol", (gpointer*) protocol);
+        g_hash_table_insert(attributes, "username", (gpointer*) username);
+
+        bc->migrating++;
+        secret_item_set_attributes(item, PURPLE_SCHEMA, attributes, bc->cancellable, on_item_migrated, bc);
+        g_hash_table_destroy(attributes);
+    }
+
+    g_hash_table_unref(legacy);
+}
+
+static void on_legacy_items_found(GObject* source, GAsyncResult* result, gpointer user_data)
+{
+    GError* error   = NULL;
+    GList* items    = secret_collection_search_finish(SECRET_COLLECTION(source), result, &error);
+
+    // Keyring is gone, so is user_data
+    if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        g_error_free(error);
+        return;
+    }
+
+    BrokerCollection* bc    = (BrokerCollection*) user_data;
+    const gchar* path       = g_dbus_proxy_get_object_path(G_DBUS_PROXY(bc->collection));
+
+    if(error != NULL)
+    {
+        g_warning("Could not search keyring %s for legacy items: %s", path, error->message);
+        g_error_free(error);
+        bc->migration_failed = TRUE;
+    }
+
+    for(GList* li = items; li != NULL; li = li->next) migrate_item(bc, li->data);
+
+    if(items != NULL) g_message("Migrating %u legacy items of keyring %s", g_list_length(items), path);
+    g_list_free_full(items, g_object_unref);
+
+    migration_done(bc);
+}
+
+// Rewrites are held until all of them are sent
+static void migrate_legacy_items(BrokerCollection* bc)
+{
+    GHashTable* attributes = g_hash_table_new(g_str_hash, g_str_equal);
+
+    bc->migrating           = 1;
+    bc->migration_failed    = FALSE;
+    broker_searches++;
+
+    // No attributes: every item of the legacy schema
+    secret_collection_search(bc->collection,
+            LEGACY_SCHEMA,
+            attributes,
+            SECRET_SEARCH_ALL,
+            bc->cancellable,
+            on_legacy_items_found,
+            bc);
+
+    g_hash_table_destroy(attributes);
+}
+
+// Legacy items are migrated first, so the index holds all of them
+static void index_build(BrokerCollection* bc)
+{
+    bc->state = INDEX_BUILDING;
+
+    if(bc->migrated) index_search(bc);
+    else if(bc->migrating == 0) migrate_legacy_items(bc);
+}
+
+// Legacy items can only be rewritten in an unlocked keyring. The index is
+// built as soon as the keyring is unlocked, before the first lookup.
+static void on_locked_changed(GObject* object, GParamSpec* pspec, gpointer user_data)
+{
+    BrokerCollection* bc = (BrokerCollection*) user_data;
+    if(secret_collection_get_locked(bc->collection)) return;
+
+    if(bc->state == INDEX_NONE)
+        index_build(bc);
+    else if((bc->state == INDEX_READY) && (!bc->migrated) && (bc->migrating == 0))
+        migrate_legacy_items(bc);
+}
+
+/**************************************************
+ **************************************************
+ ****************** Collections *******************
+ **************************************************
+ **************************************************/
+
+static void broker_collection_free(gpointer data)
+{
+    BrokerCollection* bc = data;
+
+    // Pending searches, loads and rewrites must not touch bc anymore
+    g_cancellable_cancel(bc->cancellable);
+    g_object_unref(bc->cancellable);
+
+    g_dbus_connection_signal_unsubscribe(g_dbus_proxy_get_connection(G_DBUS_PROXY(broker_service)), bc->items_subscription);
+    g_signal_handler_disconnect(bc->collection, bc->locked_handler);
+    g_hash_table_destroy(bc->index);
+    g_hash_table_destroy(bc->keys);
+    g_hash_table_destroy(bc->changed);
+    g_object_unref(bc->collection);
+    g_free(bc);
+}
+
+static void broker_collection_add(SecretCollection* collection)
+{
+    const gchar* path       = g_dbus_proxy_get_object_path(G_DBUS_PROXY(collection));
+    BrokerCollection* bc    = g_new(BrokerCollection, 1);
+
+    bc->collection  = g_object_ref(collection);
+    bc->index       = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+    bc->keys        = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    bc->changed     = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    bc->state       = INDEX_NONE;
+    bc->migrated    = FALSE;
+    bc->migration_failed = FALSE;
+    bc->migrating   = 0;
+    bc->cancellable = g_cancellable_new();
+
+    bc->items_subscription = g_dbus_connection_signal_subscribe(g_dbus_proxy_get_connection(G_DBUS_PROXY(broker_service)),
+            NULL,
+            SECRET_COLLECTION_INTERFACE,
+            NULL,
+            path,
+            NULL,
+            G_DBUS_SIGNAL_FLAGS_NONE,
+            on_items_changed,
+            bc,
+            NULL);
+
+    bc->locked_handler = g_signal_connect(collection, "notify::locked", G_CALLBACK(on_locked_changed), bc);
+
+    g_hash_table_insert(broker_collections, g_strdup(path), bc);
+    g_debug("Serving keyring %s", path);
+
+    if(!secret_collection_get_locked(collection)) index_build(bc);
+}
+
+// Keyring created or deleted
+static void sync_collections()
+{
+    GList* collections  = secret_service_get_collections(broker_service);
+    GHashTable* current = g_hash_table_new(g_str_hash, g_str_equal);
+
+    for(GList* li = collections; li != NULL; li = li->next)
+    {
+        const gchar* path = g_dbus_proxy_get_object_path(G_DBUS_PROXY(li->data));
+        g_hash_table_add(current, (gpointer) path);
+
+        if(!g_hash_table_contains(broker_collections, path)) broker_collection_add(li->data);
+    }
+
+    GHashTableIter iter;
+    gpointer path;
+    g_hash_table_iter_init(&iter, broker_collections);
+
+    while(g_hash_table_iter_next(&iter, &path, NULL))
+    {
+        if(!g_hash_table_contains(current, path)) g_hash_table_iter_remove(&iter);
+    }
+
+    g_hash_table_destroy(current);
+    g_list_free_full(collections, g_object_unref);
+}
+
+static void on_collections_changed(GObject* object, GParamSpec* pspec, gpointer user_data)
+{
+    sync_collections();
+}
+
+/**************************************************
+ **************************************************
+ **************** Broker interface ****************
+ **************************************************
+ **************************************************/
+
+// Lookup(collection, protocol, username) -> (status, item). Only the item
+// path is served, the plugin reads the secret through its own keyring session
+// so no password ever passes the broker. "/" if there is no item. Answered
+// from memory, a keyring that is not indexed yet is left to the plugin.
+static void handle_lookup(GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+    const gchar* path;
+    const gchar* protocol;
+    const gchar* username;
+    g_variant_get(parameters, "(&s&s&s)", &path, &protocol, &username);
+
+    broker_lookups++;
+    BrokerCollection* bc = g_hash_table_lookup(broker_collections, path);
+
+    // Unlocking prompts the user, that is left to the plugin instance
+    if((bc == NULL) || (secret_collection_get_locked(bc->collection)))
+    {
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(uo)", BROKER_UNAVAILABLE, "/"));
+        return;
+    }
+
+    if(bc->state != INDEX_READY)
+    {
+        if(bc->state == INDEX_NONE) index_build(bc);
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(uo)", BROKER_UNAVAILABLE, "/"));
+        return;
+    }
+
+    SecretItem* item = index_lookup(bc, protocol, username);
+
+    if(item != NULL)
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(uo)", BROKER_FOUND, g_dbus_proxy_get_object_path(G_DBUS_PROXY(item))));
+
+    // A legacy item the migration missed is still searched by the plugin
+    else if(!bc->migrated)
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(uo)", BROKER_UNAVAILABLE, "/"));
+
+    else
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(uo)", BROKER_NOT_FOUND, "/"));
+}
+
+static void answer_pings()
+{
+    for(GList* li = broker_pings; li != NULL; li = li->next)
+        g_dbus_method_invocation_return_value(li->data, g_variant_new("(b)", broker_responsive));
+
+    g_list_free(broker_pings);
+    broker_pings = NULL;
+}
+
+static gboolean on_probe_timeout(gpointer user_data)
+{
+    broker_probe_timeout = 0;
+    g_cancellable_cancel(broker_probe);
+    return G_SOURCE_REMOVE;
+}
+
+static void on_keyring_probed(GObject* source, GAsyncResult* result, gpointer user_data)
+{
+    GError* error   = NULL;
+    GList* items    = secret_service_search_finish(SECRET_SERVICE(source), result, &error);
+    g_list_free_full(items, g_object_unref);
+
+    if(broker_probe_timeout != 0) g_source_remove(broker_probe_timeout);
+    broker_probe_timeout    = 0;
+    broker_responsive       = (error == NULL);
+    broker_probed           = g_get_monotonic_time();
+
+    if(error != NULL)
+    {
+        g_message("Keyring probe failed: %s", error->message);
+        g_error_free(error);
+    }
+
+    g_clear_object(&broker_probe);
+    answer_pings();
+}
+
+// Ping() -> (responsive). Degraded plugin instances wait for the keyring to
+// answer again, one cheap search per BROKER_PROBE_CACHE serves all of them.
+static void handle_ping(GDBusMethodInvocation* invocation)
+{
+    if((broker_probed != 0) && (g_get_monotonic_time() - broker_probed < BROKER_PROBE_CACHE))
+    {
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(b)", broker_responsive));
+        return;
+    }
+
+    broker_pings = g_list_prepend(broker_pings, invocation);
+    if(broker_probe != NULL) return;
+
+    GHashTable* attributes = g_hash_table_new(g_str_hash, g_str_equal);
+    g_hash_table_insert(attributes, "program", (gpointer*) SCHEMA_PROGRAM);
+
+    broker_probe            = g_cancellable_new();
+    broker_probe_timeout    = g_timeout_add_seconds(BROKER_PROBE_TIMEOUT, on_probe_timeout, NULL);
+    broker_searches++;
+
+    secret_service_search(broker_service,
+            PURPLE_SCHEMA,
+            attributes,
+            SECRET_SEARCH_NONE,
+            broker_probe,
+            on_keyring_probed,
+            NULL);
+
+    g_hash_table_destroy(attributes);
+}
+
+static void on_method_call(GDBusConnection* connection,
+                    const gchar* sender,
+                    const gchar* path,
+                    const gchar* interface,
+                    const gchar* method,
+                    GVariant* parameters,
+                    GDBusMethodInvocation* invocation,
+                    gpointer user_data)
+{
+    if(strcmp(method, "Lookup") == 0)
+        handle_lookup(parameters, invocation);
+    else if(strcmp(method, "Ping") == 0)
+        handle_ping(invocation);
+    else
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD, "Unknown method %s", method);
+}
+
+static const GDBusInterfaceVTable broker_vtable = {on_method_call, NULL, NULL, {NULL}};
+
+static gboolean register_broker(GDBusConnection* connection)
+{
+    GError* error = NULL;
+
+    g_dbus_connection_register_object(connection,
+            BROKER_OBJECT_PATH,
+            broker_introspection->interfaces[0],
+            &broker_vtable,
+            NULL,
+            NULL,
+            &error);
+
+    if(error != NULL)
+    {
+        g_warning("Could not register broker object: %s", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**************************************************
+ **************************************************
+ ***************** Private socket *****************
+ **************************************************
+ **************************************************/
+
+// Passwords are only handed out to processes of the same user
+static gboolean on_authorize_peer(GDBusAuthObserver* observer,
+                    GIOStream* stream,
+                    GCredentials* credentials,
+                    gpointer user_data)
+{
+    GCredentials* own   = g_credentials_new();
+    gboolean authorized = (credentials != NULL) && g_credentials_is_same_user(credentials, own, NULL);
+
+    if(!authorized) g_warning("Rejected connection of another user");
+
+    g_object_unref(own);
+    return authorized;
+}
+
+static void on_connection_closed(GDBusConnection* connection, gboolean remote_peer_vanished, GError* error, gpointer user_data)
+{
+    g_object_unref(connection);
+}
+
+static gboolean on_new_connection(GDBusServer* server, GDBusConnection* connection, gpointer user_data)
+{
+    if(!register_broker(connection)) return FALSE;
+
+    // Kept until the plugin instance disconnects
+    g_object_ref(connection);
+    g_signal_connect(connection, "closed", G_CALLBACK(on_connection_closed), NULL);
+    return TRUE;
+}
+
+// Another broker already serves this socket
+static gboolean socket_in_use(const gchar* address)
+{
+    GDBusConnection* connection = g_dbus_connection_new_for_address_sync(address,
+            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+            NULL,
+            NULL,
+            NULL);
+
+    if(connection == NULL) return FALSE;
+
+    g_dbus_connection_close_sync(connection, NULL, NULL);
+    g_object_unref(connection);
+    return TRUE;
+}
+
+static GDBusServer* start_server(const gchar* path)
+{
+    GError* error           = NULL;
+    GDBusServer* server     = NULL;
+    gchar* dir              = g_path_get_dirname(path);
+    gchar* escaped          = g_dbus_address_escape_value(path);
+    gchar* address          = g_strdup_printf("unix:path=%s", escaped);
+    gchar* guid             = g_dbus_generate_guid();
+    GDBusAuthObserver* observer = g_dbus_auth_observer_new();
+
+    if(socket_in_use(address))
+    {
+        g_printerr("A broker is already running on %s\n", path);
+        goto out;
+    }
+
+    if(g_mkdir_with_parents(dir, 0700) != 0)
+    {
+        g_printerr("Could not create %s\n", dir);
+        goto out;
+    }
+
+    // Stale socket of a broker which did not exit cleanly
+    g_unlink(path);
+
+    g_signal_connect(observer, "authorize-authenticated-peer", G_CALLBACK(on_authorize_peer), NULL);
+    server = g_dbus_server_new_sync(address, G_DBUS_SERVER_FLAGS_NONE, guid, observer, NULL, &error);
+
+    if(error != NULL)
+    {
+        g_printerr("Could not listen on %s: %s\n", path, error->message);
+        g_error_free(error);
+        goto out;
+    }
+
+    g_chmod(path, 0600);
+    g_signal_connect(server, "new-connection", G_CALLBACK(on_new_connection), NULL);
+    g_dbus_server_start(server);
+    broker_socket = g_strdup(path);
+    g_message("Listening on %s", path);
+
+out:
+    g_object_unref(observer);
+    g_free(guid);
+    g_free(address);
+    g_free(escaped);
+    g_free(dir);
+    return server;
+}
+
+/**************************************************
+ **************************************************
+ ****************** Session bus *******************
+ **************************************************
+ **************************************************/
+
+static void on_bus_acquired(GDBusConnection* connection, const gchar* name, gpointer user_data)
+{
+    if(!register_broker(connection)) g_main_loop_quit(broker_loop);
+}
+
+static void on_name_lost(GDBusConnection* connection, const gchar* name, gpointer user_data)
+{
+    g_printerr("Could not own %s on the session bus\n", name);
+    g_main_loop_quit(broker_loop);
+}
+
+/**************************************************
+ **************************************************
+ ********************** Main **********************
+ **************************************************
+ **************************************************/
+
+static gboolean on_quit_signal(gpointer user_data)
+{
+    g_main_loop_quit(broker_loop);
+    return G_SOURCE_CONTINUE;
+}
+
+int main(int argc, char** argv)
+{
+    gboolean session    = FALSE;
+    gchar* path         = NULL;
+    GDBusServer* server = NULL;
+    guint owner         = 0;
+    GError* error       = NULL;
+    int status          = 1;
+
+    GOptionEntry entries[] = {
+        { "socket", 0, 0, G_OPTION_ARG_FILENAME, &path, "Private socket, defaults to $XDG_RUNTIME_DIR/purple-gnome-keyring/broker", "PATH" },
+        { "session", 0, 0, G_OPTION_ARG_NONE, &session, "Serve as " BROKER_BUS_NAME " on the session bus instead", NULL },
+        { NULL }
+    };
+
+    GOptionContext* context = g_option_context_new("- shared keyring index for purple-gnome-keyring");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if(!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    broker_service = secret_service_get_sync(SECRET_SERVICE_OPEN_SESSION | SECRET_SERVICE_LOAD_COLLECTIONS, NULL, &error);
+
+    if(error != NULL)
+    {
+        g_printerr("Could not connect to the Gnome Keyring: %s\n", error->message);
+        g_error_free(error);
+        g_free(path);
+        return 1;
+    }
+
+    broker_loop             = g_main_loop_new(NULL, FALSE);
+    broker_introspection    = g_dbus_node_info_new_for_xml(broker_introspection_xml, NULL);
+    broker_collections      = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, broker_collection_free);
+
+    sync_collections();
+    g_signal_connect(broker_service, "notify::collections", G_CALLBACK(on_collections_changed), NULL);
+
+    if(session)
+    {
+        owner = g_bus_own_name(G_BUS_TYPE_SESSION, BROKER_BUS_NAME, G_BUS_NAME_OWNER_FLAGS_NONE, on_bus_acquired, NULL, on_name_lost, NULL, NULL);
+    }
+    else
+    {
+        if(path == NULL) path = broker_socket_path();
+        server = start_server(path);
+    }
+
+    if(session || (server != NULL))
+    {
+        g_unix_signal_add(SIGINT, on_quit_signal, NULL);
+        g_unix_signal_add(SIGTERM, on_quit_signal, NULL);
+        g_main_loop_run(broker_loop);
+        status = 0;
+    }
+
+    g_message("Served %u lookups with %u keyring searches and %u item loads", broker_lookups, broker_searches, broker_item_loads);
+
+    if(owner != 0) g_bus_unown_name(owner);
+
+    if(server != NULL)
+    {
+        g_dbus_server_stop(server);
+        g_object_unref(server);
+        g_unlink(broker_socket);
+    }
+
+    g_hash_table_destroy(broker_collections);
+    g_dbus_node_info_unref(broker_introspection);
+    g_main_loop_unref(broker_loop);
+    g_object_unref(broker_service);
+    g_free(broker_socket);
+    g_free(path);
+
+    return status;
+}
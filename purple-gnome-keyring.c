@@ -17,8 +17,11 @@
 # define PURPLE_PLUGINS
 #endif
 
-#include <libsecret/secret.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
 
 #include "account.h"
 #include "connection.h"
@@ -31,11 +34,12 @@
 #include "util.h"
 #include "version.h"
 
+#include "purple-gnome-keyring.h"
+
 // Plug status
 typedef enum {ENABLED = 0, LOADED = 1, UNLOADED = 2} status_type;
 
 /* Preferences */
-#define PLUGIN_ID "core-grburst-purple_gnome_keyring"
 #define KEYRING_PLUG_STATUS_PREF "/plugins/core/purple_gnome_keyring/plug_status"
 #define KEYRING_PLUG_STATUS_DEFAULT UNLOADED
 #define KEYRING_CUSTOM_NAME_PREF "/plugins/core/purple_gnome_keyring/custom_keyring"
@@ -46,47 +50,190 @@ typedef enum {ENABLED = 0, LOADED = 1, UNLOADED = 2} status_type;
 #define KEYRING_AUTO_SAVE_DEFAULT TRUE
 #define KEYRING_AUTO_LOCK_PREF "/plugins/core/purple_gnome_keyring/auto_lock"
 #define KEYRING_AUTO_LOCK_DEFAULT FALSE
+#define KEYRING_ROUTES_PREF "/plugins/core/purple_gnome_keyring/routes"
+#define KEYRING_ROUTES_DEFAULT ""
+#define KEYRING_MIGRATED_PREF "/plugins/core/purple_gnome_keyring/migrated_keyrings"  // Object paths of keyrings without legacy items
+#define KEYRING_CALL_TIMEOUT_PREF "/plugins/core/purple_gnome_keyring/call_timeout"
+#define KEYRING_CALL_TIMEOUT_DEFAULT 3000
+#define KEYRING_RETRY_INTERVAL 10   // Seconds between probes in degraded mode
+#define BROKER_MAX_TIMEOUTS 3       // Lookups in a row that may time out before the broker is dropped
+#define KEYRING_PROFILE_PREF "/plugins/core/purple_gnome_keyring/profile_startup"
+#define KEYRING_PROFILE_DEFAULT FALSE
+#define KEYRING_BROKER_PREF "/plugins/core/purple_gnome_keyring/use_broker"
+#define KEYRING_BROKER_DEFAULT FALSE
 
 // Plugin handles
-const SecretSchema* get_purple_schema (void) G_GNUC_CONST;
-#define PURPLE_SCHEMA   get_purple_schema()
 #define SECRET_SERVICE(inst) (G_TYPE_CHECK_INSTANCE_CAST ((inst), SECRET_TYPE_SERVICE, SecretService))
 #define SECRET_ITEM(inst) (G_TYPE_CHECK_INSTANCE_CAST ((inst), SECRET_TYPE_ITEM, SecretItem))
+#define SECRET_COLLECTION(inst) (G_TYPE_CHECK_INSTANCE_CAST ((inst), SECRET_TYPE_COLLECTION, SecretCollection))
+
+// Unlock state of a keyring
+typedef enum {COLLECTION_LOCKED = 0, COLLECTION_UNLOCKING = 1, COLLECTION_UNLOCKED = 2} collection_state;
+
+// Keyring accounts can be routed to. Every keyring is unlocked on its own,
+// so a pending prompt of one keyring does not hold back the others.
+typedef struct {
+    gchar* name;                    // Keyring label, NULL for the default alias
+    SecretCollection* collection;
+    collection_state state;
+    GQueue* pending;                // PendingOperations waiting for the unlock
+    GCancellable* cancellable;
+    guint migrating;                // Items still being rewritten to SCHEMA_VERSION, 0 if no migration runs
+    gboolean migrated;              // No legacy items left, listed in KEYRING_MIGRATED_PREF
+    gboolean migration_failed;      // Retried on the next load
+} KeyringCollection;
+
+// Routing rule: "protocol[/username]=keyring", patterns may use * and ?
+typedef struct {
+    GPatternSpec* protocol;
+    GPatternSpec* username;
+    KeyringCollection* target;
+} KeyringRoute;
+
+// Account handed to async callbacks. The account may be freed before the
+// callback runs, so it is resolved again through plugin_credentials.
+typedef struct {
+    PurpleAccount* account;
+    guint serial;                   // Tells a new account at a reused address apart
+    gchar* protocol_id;             // For messages once the account is gone
+} AccountRef;
+
+// Call deferred until its keyring is unlocked, func(data, NULL)
+typedef struct {
+    GFunc func;
+    gpointer data;
+    GDestroyNotify destroy;         // Frees data once the operation ran or was dropped
+    AccountRef* account;            // If set, resolved and passed instead of data
+} PendingOperation;
+
+// Keyring items of a renamed account, moved over to the new name
+typedef struct {
+    AccountRef* account;            // Resolves to the credential of the new name
+    KeyringCollection* from;        // Keyring of the old name
+    GHashTable* attributes;         // PURPLE_SCHEMA attributes of the old name, owns its values
+    GList* items;                   // Items of the old name, once found
+    gboolean discard;               // Delete the items of the old name instead of moving them
+} RenameRequest;
+
+// Keyring side of an account, built once and shared by all pipelines.
+// Rebuilt only if the username or protocol of the account changes.
+typedef struct {
+    PurpleAccount* account;
+    guint serial;                   // Kept on rebuild, new for every account
+    gchar* protocol_id;
+    gchar* username;
+    GHashTable* attributes;         // Attributes of PURPLE_SCHEMA
+    GHashTable* legacy_attributes;  // Attributes of LEGACY_SCHEMA
+    gchar* label;
+    KeyringCollection* collection;  // Routed keyring
+    gchar* keyring_digest;          // password_digest of the keyring item, NULL if unknown
+    gchar* pending_digest;          // Store in flight
+    RenameRequest* rename;          // Items of the old name, taken once the account is used
+} AccountCredential;
+
+// Keyring health, degraded if a call ran into its deadline
+typedef enum {KEYRING_HEALTHY = 0, KEYRING_DEGRADED = 1} keyring_health;
+
+// Keyring call guarded by the watchdog, cancelled once its deadline passes
+typedef struct {
+    const gchar* name;
+    guint timeout;                  // ms
+    gint64 started;                 // Monotonic, us
+    GCancellable* cancellable;
+    GSource* deadline;              // Attached to the watchdog context
+} KeyringCall;
+
+// Watchdog counters, latencies in us
+typedef struct {
+    guint calls;
+    guint timeouts;
+    guint spikes;                   // Calls slower than half their deadline
+    gint64 total_latency;
+    gint64 max_latency;
+} KeyringStats;
+
+// Start of a profiled startup phase
+typedef struct {
+    gint64 started;                 // Monotonic, us
+    guint calls;                    // plugin_dbus_calls at start
+} ProfileMark;
+
+// Finished startup phase
+typedef struct {
+    gchar* name;
+    gint64 elapsed;                 // us
+    guint calls;
+} ProfilePhase;
+
+// Plaintext copies made by one load or store
+typedef struct {
+    guint secure;                   // SecretValues, in libsecret's secure memory
+    guint messages;                 // D-Bus messages carrying the secret
+    guint account;                  // account->password, strdup'd by libpurple
+    guint digests;                  // password_digest buffers
+} SecretCopies;
+
+// Store in flight, the digest is committed once the keyring confirms it
+typedef struct {
+    AccountRef* account;
+    gchar* digest;
+    KeyringCall* call;
+    SecretCopies copies;
+} StoreRequest;
 
 // Vars
-PurplePlugin* gnome_keyring_plugin  = NULL;
-SecretCollection* plugin_collection = NULL;
-SecretService* plugin_service       = NULL;
+PurplePlugin* gnome_keyring_plugin      = NULL;
+KeyringCollection* plugin_collection    = NULL;     // Keyring chosen in the preferences
+GList* plugin_collections               = NULL;     // All keyrings, including plugin_collection
+GList* plugin_routes                    = NULL;
+SecretService* plugin_service           = NULL;
+GHashTable* plugin_credentials          = NULL;     // PurpleAccount* -> AccountCredential*, live accounts only
+guint plugin_credential_serial          = 0;
+guchar plugin_digest_key[32];                       // Random per load, see password_digest
+SecretCopies* plugin_copies             = NULL;     // Counters of the running load or store, NULL if none
+keyring_health plugin_health            = KEYRING_HEALTHY;
+KeyringStats plugin_stats;
+GQueue* plugin_deferred                 = NULL;     // AccountRefs whose load waits for the keyring
+guint plugin_retry_source               = 0;
+gboolean plugin_probe_running           = FALSE;
+GMainContext* plugin_watchdog_context   = NULL;
+GMainLoop* plugin_watchdog_loop         = NULL;
+GThread* plugin_watchdog_thread         = NULL;
+GArray* plugin_profile                  = NULL;     // ProfilePhases, only while a profiled load runs
+GDBusConnection* plugin_broker          = NULL;     // Credential broker, NULL if not used
+guint plugin_broker_timeouts            = 0;        // Broker lookups timed out in a row
+GDBusConnection* plugin_bus             = NULL;     // Session bus shared with libsecret, NULL without counter
+guint plugin_bus_filter                 = 0;
+gint plugin_dbus_calls                  = 0;        // Atomic, outgoing method calls to the keyring and broker
 
 /**************************************************
  **************************************************
  **************** Schema related ******************
  **************************************************
  **************************************************/
-const SecretSchema* get_purple_schema(void)
+// Migrated keyrings are remembered by object path, so a keyring that shows up
+// later through a route or a new keyring name is still migrated
+static gboolean keyring_path_migrated(const gchar* path)
 {
-    static const SecretSchema schema = {
-        "pidgin password scheme", SECRET_SCHEMA_NONE,
-        {
-            /* {  "program", SECRET_SCHEMA_ATTRIBUTE_STRING }, */
-            {  "protocol", SECRET_SCHEMA_ATTRIBUTE_STRING },
-            {  "username", SECRET_SCHEMA_ATTRIBUTE_STRING },
-            {  "NULL", 0 },
-        }
-    };
-    return &schema;
+    GList* paths    = purple_prefs_get_string_list(KEYRING_MIGRATED_PREF);
+    gboolean found  = (g_list_find_custom(paths, path, (GCompareFunc) g_strcmp0) != NULL);
+
+    g_list_free_full(paths, g_free);
+    return found;
 }
 
-static GHashTable* get_attributes(PurpleAccount* account)
+// Duplicates resolve to the most recently modified item, see item_is_newer
+static SecretItem* get_newest_item(GList* items)
 {
-    const gchar* id  = purple_account_get_protocol_id(account);
-    const gchar* un  = purple_account_get_username(account);
+    SecretItem* newest = NULL;
 
-    GHashTable* attributes  = g_hash_table_new(g_str_hash, g_str_equal);
-    g_hash_table_insert(attributes, "protocol" , (gpointer*) id);
-    g_hash_table_insert(attributes, "username" , (gpointer*) un);
+    for(GList* li = items; li != NULL; li = li->next)
+    {
+        if((newest == NULL) || item_is_newer(li->data, newest))
+            newest = li->data;
+    }
 
-    return attributes;
+    return newest;
 }
 /**************************************************
  **************************************************
@@ -134,22 +281,409 @@ static void print_protocol_error_message(const gchar* protocol_name, gchar* prim
 /* } */
 
 
+/**************************************************
+ **************************************************
+ **************** Secret handling *****************
+ **************************************************
+ **************************************************/
+
+// Plaintext passwords live in libsecret's secure memory, except for
+// account->password which is owned by libpurple. Every copy we drop is
+// wiped before it is freed. Each copy site counts into plugin_copies, the
+// totals are logged once a load or store is done.
+
+#define COUNT_COPY(field) do { if(plugin_copies != NULL) plugin_copies->field++; } while(0)
+
+static void report_secret_copies(const gchar* operation, const gchar* protocol_id, const SecretCopies* copies)
+{
+    purple_debug_info(PLUGIN_ID, "%s %s password made %u copies in secure memory, %u in D-Bus messages, %u account copies, %u digests\n",
+            operation,
+            protocol_id,
+            copies->secure,
+            copies->messages,
+            copies->account,
+            copies->digests);
+}
+
+// Wipe the account copy in place before it is freed
+static void account_clear_password(PurpleAccount* account)
+{
+    if(account->password == NULL) return;
+
+    secret_password_wipe(account->password);
+    g_free(account->password);
+    account->password = NULL;
+}
+
+// libpurple frees the old copy without wiping it
+static void account_set_password(PurpleAccount* account, const gchar* password)
+{
+    account_clear_password(account);
+    purple_account_set_password(account, password);
+    COUNT_COPY(account);
+}
+
+// Read a secret without caching it in an item, it is wiped on unref
+static SecretValue* load_path_secret(const gchar* path, GCancellable* cancellable, GError** error)
+{
+    SecretValue* value = secret_service_get_secret_for_dbus_path_sync(plugin_service, path, cancellable, error);
+
+    // GetSecret reply, decoded into secure memory
+    if(value != NULL)
+    {
+        COUNT_COPY(messages);
+        COUNT_COPY(secure);
+    }
+
+    return value;
+}
+
+static SecretValue* load_item_secret(SecretItem* item, GCancellable* cancellable, GError** error)
+{
+    return load_path_secret(g_dbus_proxy_get_object_path(G_DBUS_PROXY(item)), cancellable, error);
+}
+
+// Fill the digest key from the kernel CSPRNG, FALSE if no source is usable
+static gboolean init_digest_key()
+{
+    gsize filled = 0;
+
+    while(filled < sizeof(plugin_digest_key))
+    {
+        gssize n = getrandom(plugin_digest_key + filled, sizeof(plugin_digest_key) - filled, 0);
+        if(n > 0) filled += n;
+        else if(errno != EINTR) break;
+    }
+
+    if(filled == sizeof(plugin_digest_key)) return TRUE;
+
+    // Kernels before 3.17 have no getrandom
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return FALSE;
+
+    for(filled = 0; filled < sizeof(plugin_digest_key);)
+    {
+        gssize n = read(fd, plugin_digest_key + filled, sizeof(plugin_digest_key) - filled);
+        if(n > 0) filled += n;
+        else if((n == 0) || (errno != EINTR)) break;
+    }
+
+    close(fd);
+    return filled == sizeof(plugin_digest_key);
+}
+
+// Keyed with a random per-load key, so the digest reveals nothing outside this
+// process. Digests are wiped like passwords, free them with secret_password_free.
+static gchar* password_digest(const gchar* password)
+{
+    COUNT_COPY(digests);
+    return g_compute_hmac_for_string(G_CHECKSUM_SHA256, plugin_digest_key, sizeof(plugin_digest_key), password, -1);
+}
+
+
+/**************************************************
+ **************************************************
+ *************** Account references ***************
+ **************************************************
+ **************************************************/
+
+static AccountRef* account_ref_new(AccountCredential* cred)
+{
+    AccountRef* ref     = g_new(AccountRef, 1);
+    ref->account        = cred->account;
+    ref->serial         = cred->serial;
+    ref->protocol_id    = g_strdup(cred->protocol_id);
+
+    return ref;
+}
+
+static AccountRef* account_ref_copy(AccountRef* ref)
+{
+    AccountRef* copy    = g_new(AccountRef, 1);
+    copy->account       = ref->account;
+    copy->serial        = ref->serial;
+    copy->protocol_id   = g_strdup(ref->protocol_id);
+
+    return copy;
+}
+
+// NULL if the account was removed or the plugin unloaded meanwhile
+static PurpleAccount* account_ref_get(AccountRef* ref)
+{
+    if(plugin_credentials == NULL) return NULL;
+
+    AccountCredential* cred = g_hash_table_lookup(plugin_credentials, ref->account);
+    if((cred == NULL) || (cred->serial != ref->serial)) return NULL;
+
+    return ref->account;
+}
+
+static void account_ref_free(AccountRef* ref)
+{
+    g_free(ref->protocol_id);
+    g_free(ref);
+}
+
+static void pending_operation_free(PendingOperation* op)
+{
+    if(op->account != NULL) account_ref_free(op->account);
+    if(op->destroy != NULL) op->destroy(op->data);
+    g_free(op);
+}
+
+
+/**************************************************
+ **************************************************
+ **************** Keyring watchdog ****************
+ **************************************************
+ **************************************************/
+
+// Sync libsecret calls spin their own main context, so deadlines are
+// enforced from a separate thread which cancels the call. Only calls that
+// cannot prompt get a deadline: cancelling an unlock dismisses its prompt,
+// and unlocks run asynchronously anyway.
+
+static gpointer watchdog_thread(gpointer data)
+{
+    g_main_loop_run(plugin_watchdog_loop);
+    return NULL;
+}
+
+static gboolean watchdog_quit(gpointer data)
+{
+    g_main_loop_quit(plugin_watchdog_loop);
+    return G_SOURCE_REMOVE;
+}
+
+static void watchdog_start()
+{
+    memset(&plugin_stats, 0, sizeof(plugin_stats));
+    plugin_health           = KEYRING_HEALTHY;
+    plugin_probe_running    = FALSE;
+    plugin_deferred         = g_queue_new();
+
+    plugin_watchdog_context = g_main_context_new();
+    plugin_watchdog_loop    = g_main_loop_new(plugin_watchdog_context, FALSE);
+    plugin_watchdog_thread  = g_thread_new("keyring-watchdog", watchdog_thread, NULL);
+}
+
+static void watchdog_stop()
+{
+    // Dispatched by the running watchdog loop. g_main_context_invoke could run
+    // it right here if the context is free, before the loop even started.
+    GSource* quit = g_idle_source_new();
+    g_source_set_callback(quit, watchdog_quit, NULL, NULL);
+    g_source_attach(quit, plugin_watchdog_context);
+    g_source_unref(quit);
+    g_thread_join(plugin_watchdog_thread);
+
+    g_main_loop_unref(plugin_watchdog_loop);
+    g_main_context_unref(plugin_watchdog_context);
+    plugin_watchdog_thread  = NULL;
+    plugin_watchdog_loop    = NULL;
+    plugin_watchdog_context = NULL;
+
+    if(plugin_retry_source != 0) g_source_remove(plugin_retry_source);
+    plugin_retry_source = 0;
+
+    g_queue_free_full(plugin_deferred, (GDestroyNotify) account_ref_free);
+    plugin_deferred = NULL;
+}
+
+static guint call_timeout()
+{
+    return MAX(purple_prefs_get_int(KEYRING_CALL_TIMEOUT_PREF), 100);
+}
+
+// Runs on the watchdog thread
+static gboolean on_call_deadline(gpointer data)
+{
+    g_cancellable_cancel((GCancellable*) data);
+    return G_SOURCE_REMOVE;
+}
+
+// Pass call->cancellable to the keyring call, then hand it to keyring_call_end
+static KeyringCall* keyring_call_begin(const gchar* name, guint timeout)
+{
+    KeyringCall* call   = g_new(KeyringCall, 1);
+    call->name          = name;
+    call->timeout       = timeout;
+    call->started       = g_get_monotonic_time();
+    call->cancellable   = g_cancellable_new();
+
+    call->deadline      = g_timeout_source_new(timeout);
+    g_source_set_callback(call->deadline, on_call_deadline, g_object_ref(call->cancellable), g_object_unref);
+    g_source_attach(call->deadline, plugin_watchdog_context);
+
+    plugin_stats.calls++;
+    return call;
+}
+
+// Record the latency and free call. TRUE if the call ran into its deadline.
+static gboolean keyring_call_end(KeyringCall* call, const GError* error)
+{
+    gint64 latency      = g_get_monotonic_time() - call->started;
+    gboolean timed_out  = g_cancellable_is_cancelled(call->cancellable) && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+
+    g_source_destroy(call->deadline);
+    g_source_unref(call->deadline);
+    g_object_unref(call->cancellable);
+
+    plugin_stats.total_latency += latency;
+    plugin_stats.max_latency    = MAX(plugin_stats.max_latency, latency);
+
+    if(timed_out)
+    {
+        plugin_stats.timeouts++;
+        purple_debug_warning(PLUGIN_ID, "Keyring call %s timed out after %u ms\n", call->name, call->timeout);
+    }
+    else if(latency > (gint64) call->timeout * 1000 / 2)
+    {
+        plugin_stats.spikes++;
+        purple_debug_warning(PLUGIN_ID, "Keyring latency spike: %s took %" G_GINT64_FORMAT " ms of %u ms\n", call->name, latency / 1000, call->timeout);
+    }
+
+    g_free(call);
+    return timed_out;
+}
+
+static guint dbus_calls();
+
+static void report_keyring_stats()
+{
+    purple_debug_info(PLUGIN_ID, "D-Bus calls: %u, calls with deadline: %u, timeouts: %u, latency spikes: %u, max latency: %" G_GINT64_FORMAT " ms, avg latency: %" G_GINT64_FORMAT " ms\n",
+            dbus_calls(),
+            plugin_stats.calls,
+            plugin_stats.timeouts,
+            plugin_stats.spikes,
+            plugin_stats.max_latency / 1000,
+            (plugin_stats.calls > 0) ? plugin_stats.total_latency / plugin_stats.calls / 1000 : 0);
+}
+
+
+/**************************************************
+ **************************************************
+ *************** Startup profiling ****************
+ **************************************************
+ **************************************************/
+
+// Method calls are counted where they leave the process, a filter on the
+// session bus and on the broker connection. So calls libsecret makes on its
+// own, e.g. to load item properties, show up as well. Other users of the
+// shared session bus in the client are counted too.
+
+// Runs on the GDBus worker thread
+static GDBusMessage* count_dbus_call(GDBusConnection* connection, GDBusMessage* message, gboolean incoming, gpointer user_data)
+{
+    if((!incoming) && (g_dbus_message_get_message_type(message) == G_DBUS_MESSAGE_TYPE_METHOD_CALL)
+            && (g_strcmp0(g_dbus_message_get_destination(message), "org.freedesktop.DBus") != 0))
+        g_atomic_int_inc(&plugin_dbus_calls);
+
+    return message;
+}
+
+static guint dbus_calls()
+{
+    return g_atomic_int_get(&plugin_dbus_calls);
+}
+
+// Before the first keyring call, libsecret connects to the same bus
+static void dbus_counter_start()
+{
+    GError* error = NULL;
+
+    g_atomic_int_set(&plugin_dbus_calls, 0);
+    plugin_bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+
+    if(error != NULL)
+    {
+        purple_debug_warning(PLUGIN_ID, "Not counting D-Bus calls: %s\n", error->message);
+        g_error_free(error);
+        return;
+    }
+
+    plugin_bus_filter = g_dbus_connection_add_filter(plugin_bus, count_dbus_call, NULL, NULL);
+}
+
+static void dbus_counter_stop()
+{
+    if(plugin_bus == NULL) return;
+
+    g_dbus_connection_remove_filter(plugin_bus, plugin_bus_filter);
+    g_object_unref(plugin_bus);
+    plugin_bus          = NULL;
+    plugin_bus_filter   = 0;
+}
+
+static void profile_phase_clear(gpointer data)
+{
+    g_free(((ProfilePhase*) data)->name);
+}
+
+static void profile_start()
+{
+    if(!purple_prefs_get_bool(KEYRING_PROFILE_PREF)) return;
+
+    plugin_profile = g_array_new(FALSE, FALSE, sizeof(ProfilePhase));
+    g_array_set_clear_func(plugin_profile, profile_phase_clear);
+}
+
+static ProfileMark profile_begin()
+{
+    ProfileMark mark = {g_get_monotonic_time(), dbus_calls()};
+    return mark;
+}
+
+// Takes ownership of name
+static void profile_end(const ProfileMark* mark, gchar* name)
+{
+    if(plugin_profile == NULL)
+    {
+        g_free(name);
+        return;
+    }
+
+    ProfilePhase phase  = {name, g_get_monotonic_time() - mark->started, dbus_calls() - mark->calls};
+    g_array_append_val(plugin_profile, phase);
+}
+
+// One table for the whole load, rows in the order the phases finished
+static void profile_report()
+{
+    if(plugin_profile == NULL) return;
+
+    GString* table = g_string_new("Startup profile:\n");
+    g_string_append_printf(table, "    %-48s %10s %6s\n", "Phase", "ms", "D-Bus");
+
+    for(guint i = 0; i < plugin_profile->len; i++)
+    {
+        ProfilePhase* phase = &g_array_index(plugin_profile, ProfilePhase, i);
+        g_string_append_printf(table, "    %-48s %10.1f %6u\n", phase->name, phase->elapsed / 1000.0, phase->calls);
+    }
+
+    purple_debug_info(PLUGIN_ID, "%s", table->str);
+    g_string_free(table, TRUE);
+
+    g_array_free(plugin_profile, TRUE);
+    plugin_profile = NULL;
+}
+
+
 /**************************************************
  **************************************************
  *********** Collection initalization *************
  **************************************************
  **************************************************/
 
-static SecretCollection* get_collection(SecretService* service)
+// Look up a keyring by its label, NULL selects the default alias
+static SecretCollection* get_collection(SecretService* service, const gchar* collection_name)
 {
 
     SecretCollection* collection    = NULL;
 
-    // Check if user defined a different collection name (not the alias default)
-    if(purple_prefs_get_bool(KEYRING_CUSTOM_NAME_PREF))
+    if(collection_name != NULL)
     {
 
-        const gchar* collection_name    = purple_prefs_get_string(KEYRING_NAME_PREF);
         GList* collections = secret_service_get_collections(service);
 
         if (!collections)
@@ -161,21 +695,21 @@ static SecretCollection* get_collection(SecretService* service)
         for(GList* li = collections; li != NULL; li = li->next)
         {
             gchar* label = secret_collection_get_label(li->data);
-            if(strcmp(label, collection_name) == 0)
+            if((collection == NULL) && (strcmp(label, collection_name) == 0))
             {
-                collection = li->data;
-                break;
+                collection = g_object_ref(li->data);
             }
+            g_free(label);
         }
 
-        g_list_free(collections);
+        g_list_free_full(collections, g_object_unref);
     }
     else
     {
         GError* error   = NULL;
         collection      = secret_collection_for_alias_sync(service,
                 SECRET_COLLECTION_DEFAULT,
-                SECRET_COLLECTION_LOAD_ITEMS,
+                SECRET_COLLECTION_NONE,
                 NULL,
                 &error);
 
@@ -189,18 +723,118 @@ static SecretCollection* get_collection(SecretService* service)
     return collection;
 }
 
+// Find or register a keyring by name
+static KeyringCollection* keyring_collection_get(const gchar* name)
+{
+    for(GList* li = plugin_collections; li != NULL; li = li->next)
+    {
+        KeyringCollection* kc = li->data;
+        if(g_strcmp0(kc->name, name) == 0) return kc;
+    }
+
+    KeyringCollection* kc   = g_new0(KeyringCollection, 1);
+    kc->name                = g_strdup(name);
+    kc->state               = COLLECTION_LOCKED;
+    kc->pending             = g_queue_new();
+    kc->cancellable         = g_cancellable_new();
+    plugin_collections      = g_list_append(plugin_collections, kc);
+
+    return kc;
+}
+
+static void keyring_collection_free(KeyringCollection* kc)
+{
+    // Pending unlocks must not touch kc anymore
+    g_cancellable_cancel(kc->cancellable);
+    g_object_unref(kc->cancellable);
+    g_queue_free_full(kc->pending, (GDestroyNotify) pending_operation_free);
+
+    if(kc->collection != NULL) g_object_unref(kc->collection);
+    g_free(kc->name);
+    g_free(kc);
+}
+
+static const gchar* keyring_collection_name(KeyringCollection* kc)
+{
+    return (kc->name != NULL) ? kc->name : "(default)";
+}
+
+// Sync state with the daemon, an unlock in progress is left alone
+static void update_collection_state(KeyringCollection* kc)
+{
+    if(kc->state == COLLECTION_UNLOCKING) return;
+
+    if((kc->collection != NULL) && (!secret_collection_get_locked(kc->collection)))
+        kc->state = COLLECTION_UNLOCKED;
+    else
+        kc->state = COLLECTION_LOCKED;
+}
+
+// Parse KEYRING_ROUTES_PREF: "protocol[/username]=keyring;..."
+static void load_routes()
+{
+    const gchar* routes = purple_prefs_get_string(KEYRING_ROUTES_PREF);
+    gchar** rules       = g_strsplit((routes != NULL) ? routes : "", ";", -1);
+
+    for(gchar** rule = rules; *rule != NULL; rule++)
+    {
+        gchar** parts = g_strsplit(*rule, "=", 2);
+
+        if((parts[0] == NULL) || (parts[1] == NULL))
+        {
+            if(g_strstrip(*rule)[0] != '\0')
+                purple_debug_warning(PLUGIN_ID, "Ignoring malformed keyring route \"%s\"\n", *rule);
+
+            g_strfreev(parts);
+            continue;
+        }
+
+        gchar** match           = g_strsplit(g_strstrip(parts[0]), "/", 2);
+        const gchar* keyring    = g_strstrip(parts[1]);
+
+        KeyringRoute* route = g_new(KeyringRoute, 1);
+        route->protocol     = g_pattern_spec_new(match[0]);
+        route->username     = g_pattern_spec_new((match[1] != NULL) ? match[1] : "*");
+        route->target       = keyring_collection_get((strcmp(keyring, "default") == 0) ? NULL : keyring);
+        plugin_routes       = g_list_append(plugin_routes, route);
+
+        purple_debug_info(PLUGIN_ID, "Routing %s to keyring %s\n", parts[0], keyring_collection_name(route->target));
+
+        g_strfreev(match);
+        g_strfreev(parts);
+    }
+
+    g_strfreev(rules);
+}
+
+// First matching route wins, otherwise the keyring from the preferences
+static KeyringCollection* get_account_collection(PurpleAccount* account)
+{
+    const gchar* id  = purple_account_get_protocol_id(account);
+    const gchar* un  = purple_account_get_username(account);
+
+    for(GList* li = plugin_routes; li != NULL; li = li->next)
+    {
+        KeyringRoute* route = li->data;
+        if(g_pattern_match_string(route->protocol, id) && g_pattern_match_string(route->username, un))
+            return route->target;
+    }
+
+    return plugin_collection;
+}
+
 // lock collection
-static gboolean lock_collection()
+static gboolean lock_collection(KeyringCollection* kc)
 {
     gboolean was_unlocked = FALSE;
 
-    if((plugin_collection != NULL) && (!secret_collection_get_locked(plugin_collection)))
+    if((kc->collection != NULL) && (!secret_collection_get_locked(kc->collection)))
     {
         was_unlocked = TRUE;
 
         GError* error   = NULL;
         GList* unlocked_collections   = NULL;
-        unlocked_collections = g_list_append(unlocked_collections, plugin_collection);
+        unlocked_collections = g_list_append(unlocked_collections, kc->collection);
 
         GList* locked_collections = NULL;
 
@@ -213,13 +847,13 @@ static gboolean lock_collection()
 
         if(error != NULL)
         {
-            dialog( PURPLE_NOTIFY_MSG_ERROR, "Could not unlock Gnome Keyring.", error->message);
+            dialog( PURPLE_NOTIFY_MSG_ERROR, "Could not lock Gnome Keyring.", error->message);
             g_error_free(error);
         }
         else if(locked_collections != NULL)
         {
-            plugin_collection = locked_collections->data;
-            g_list_free(locked_collections);
+            kc->state = COLLECTION_LOCKED;
+            g_list_free_full(locked_collections, g_object_unref);
         }
 
         g_list_free(unlocked_collections);
@@ -229,285 +863,1513 @@ static gboolean lock_collection()
     return was_unlocked;
 }
 
-// unlock collection
-static gboolean unlock_collection()
+// Background unlock finished, run or drop what queued up meanwhile
+static void on_collection_unlocked(GObject* source,
+                    GAsyncResult* result,
+                    gpointer user_data)
 {
-    gboolean was_locked = FALSE;
+    GError* error               = NULL;
+    GList* unlocked_collections = NULL;
+    secret_service_unlock_finish(SECRET_SERVICE(source), result, &unlocked_collections, &error);
+    g_list_free_full(unlocked_collections, g_object_unref);
 
-    if((plugin_collection != NULL) && (secret_collection_get_locked(plugin_collection)))
+    // Plugin was unloaded, user_data is gone
+    if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
     {
-        was_locked = TRUE;
-        GList* locked_collections   = NULL;
-        locked_collections = g_list_append(locked_collections, plugin_collection);
+        g_error_free(error);
+        return;
+    }
 
-        GError* error   = NULL;
-        GList* unlocked_collections = NULL;
+    KeyringCollection* kc   = (KeyringCollection*) user_data;
+    PendingOperation* op    = NULL;
 
-        secret_service_unlock_sync(
-                plugin_service,
-                locked_collections,
-                NULL,
-                &unlocked_collections,
-                &error);
+    if(error != NULL)
+    {
+        dialog( PURPLE_NOTIFY_MSG_ERROR, "Could not unlock Gnome Keyring.", error->message);
+        g_error_free(error);
+    }
 
-        if(error != NULL)
-        {
-            dialog( PURPLE_NOTIFY_MSG_ERROR, "Could not unlock Gnome Keyring.", error->message);
-            g_error_free(error);
-        }
-        else if(unlocked_collections != NULL)
-        {
-            plugin_collection = unlocked_collections->data;
-            g_list_free(unlocked_collections);
-        }
+    kc->state = COLLECTION_LOCKED;
+    update_collection_state(kc);
+
+    if(kc->state != COLLECTION_UNLOCKED)
+        purple_debug_info(PLUGIN_ID, "Keyring %s stays locked. Dropping %u pending operations\n", keyring_collection_name(kc), g_queue_get_length(kc->pending));
+
+    while((op = g_queue_pop_head(kc->pending)) != NULL)
+    {
+        gpointer data = (op->account != NULL) ? account_ref_get(op->account) : op->data;
+
+        if((kc->state == COLLECTION_UNLOCKED) && (data != NULL)) op->func(data, NULL);
+        pending_operation_free(op);
+    }
+}
+
+// Queue func(data, NULL) and unlock the keyring in the background
+static void queue_operation(KeyringCollection* kc, GFunc func, gpointer data, GDestroyNotify destroy, AccountRef* account)
+{
+    PendingOperation* op    = g_new(PendingOperation, 1);
+    op->func                = func;
+    op->data                = data;
+    op->destroy             = destroy;
+    op->account             = account;
+    g_queue_push_tail(kc->pending, op);
+
+    if(kc->state == COLLECTION_LOCKED)
+    {
+        kc->state = COLLECTION_UNLOCKING;
+
+        GList* locked_collections = g_list_append(NULL, kc->collection);
+        secret_service_unlock(plugin_service, locked_collections, kc->cancellable, on_collection_unlocked, kc);
+        g_list_free(locked_collections);
+    }
+}
+
+// TRUE if the keyring of cred can be used right away. Otherwise func(account) is
+// queued and the keyring gets unlocked in the background, other keyrings keep working.
+static gboolean collection_ready(AccountCredential* cred, GFunc func)
+{
+    KeyringCollection* kc = cred->collection;
+
+    if((kc == NULL) || (kc->collection == NULL))
+    {
+        purple_debug_info(PLUGIN_ID, "No keyring available for %s with username %s\n", cred->protocol_id, cred->username);
+        return FALSE;
+    }
+
+    update_collection_state(kc);
+    if(kc->state == COLLECTION_UNLOCKED) return TRUE;
+
+    queue_operation(kc, func, NULL, NULL, account_ref_new(cred));
+    return FALSE;
+}
+
+
+// Resolve the registered keyrings once plugin_service is connected
+static void connect_collections()
+{
+    for(GList* li = plugin_collections; li != NULL; li = li->next)
+    {
+        KeyringCollection* kc   = li->data;
+        kc->collection          = get_collection(plugin_service, kc->name);
+
+        if(kc->collection == NULL)
+            dialog( PURPLE_NOTIFY_MSG_ERROR, "Could not load collection.", keyring_collection_name(kc));
+        else
+            kc->migrated = keyring_path_migrated(g_dbus_proxy_get_object_path(G_DBUS_PROXY(kc->collection)));
+
+        update_collection_state(kc);
+    }
+}
+
+static void keyring_degrade();
+
+// Init collection. Keyrings are registered even without a connection, so
+// credentials can point to them before the keyring shows up.
+static void init_collection()
+{
+    plugin_collection   = keyring_collection_get(purple_prefs_get_bool(KEYRING_CUSTOM_NAME_PREF) ? purple_prefs_get_string(KEYRING_NAME_PREF) : NULL);
+    load_routes();
+
+    GError* error       = NULL;
+    KeyringCall* call   = keyring_call_begin("connect", call_timeout());
+    SecretService* service = secret_service_get_sync(SECRET_SERVICE_OPEN_SESSION | SECRET_SERVICE_LOAD_COLLECTIONS, call->cancellable, &error);
+
+    // Slow keyring: loads are deferred and the probe connects later
+    if(keyring_call_end(call, error))
+    {
+        g_error_free(error);
+        keyring_degrade();
+        return;
+    }
+    else if(error != NULL)
+    {
+        dialog( PURPLE_NOTIFY_MSG_ERROR, "Could not connect to the Gnome Keyring.", error->message);
+        g_error_free(error);
+        return;
+    }
+
+    plugin_service = service;
+    connect_collections();
+}
+
+// Drop routes and keyrings
+static void free_collections()
+{
+    for(GList* li = plugin_routes; li != NULL; li = li->next)
+    {
+        KeyringRoute* route = li->data;
+        g_pattern_spec_free(route->protocol);
+        g_pattern_spec_free(route->username);
+        g_free(route);
+    }
+    g_list_free(plugin_routes);
+    plugin_routes = NULL;
+
+    g_list_free_full(plugin_collections, (GDestroyNotify) keyring_collection_free);
+    plugin_collections  = NULL;
+    plugin_collection   = NULL;
+}
+
+
+/**************************************************
+ **************************************************
+ ************** Account credentials ***************
+ **************************************************
+ **************************************************/
+
+// Remember which password the keyring holds for cred
+static void set_keyring_digest(AccountCredential* cred, const gchar* password)
+{
+    secret_password_free(cred->keyring_digest);
+    cred->keyring_digest = (password != NULL) ? password_digest(password) : NULL;
+}
+
+static void move_renamed_items(gpointer data, gpointer user_data);
+
+static GHashTable* copy_attributes(GHashTable* attributes)
+{
+    GHashTable* copy = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, attributes);
+    while(g_hash_table_iter_next(&iter, &key, &value))
+        g_hash_table_insert(copy, key, g_strdup(value));
+
+    return copy;
+}
+
+// NULL if the old name had no keyring to move items from
+static RenameRequest* rename_request_new(AccountCredential* old, AccountCredential* cred)
+{
+    if((old->collection == NULL) || (old->collection->collection == NULL)) return NULL;
+
+    RenameRequest* request  = g_new(RenameRequest, 1);
+    request->account        = account_ref_new(cred);
+    request->from           = old->collection;
+    request->attributes     = copy_attributes(old->attributes);
+    request->items          = NULL;
+    request->discard        = FALSE;
+
+    return request;
+}
+
+static RenameRequest* rename_request_copy(RenameRequest* request)
+{
+    RenameRequest* copy = g_new(RenameRequest, 1);
+    copy->account       = account_ref_copy(request->account);
+    copy->from          = request->from;
+    copy->attributes    = copy_attributes(request->attributes);
+    copy->items         = NULL;
+    copy->discard       = request->discard;
+
+    return copy;
+}
+
+static void rename_request_free(RenameRequest* request)
+{
+    account_ref_free(request->account);
+    g_hash_table_destroy(request->attributes);
+    g_list_free_full(request->items, g_object_unref);
+    g_free(request);
+}
+
+static void account_credential_free(AccountCredential* cred)
+{
+    g_hash_table_destroy(cred->attributes);
+    g_hash_table_destroy(cred->legacy_attributes);
+    g_free(cred->protocol_id);
+    g_free(cred->username);
+    g_free(cred->label);
+    secret_password_free(cred->keyring_digest);
+    secret_password_free(cred->pending_digest);
+    if(cred->rename != NULL) rename_request_free(cred->rename);
+    g_free(cred);
+}
+
+// Cached credential, lookups on an unchanged account do not allocate. A lookup
+// never writes to the keyring, see take_renamed_items.
+static AccountCredential* get_account_credential(PurpleAccount* account)
+{
+    const gchar* id             = purple_account_get_protocol_id(account);
+    const gchar* un             = purple_account_get_username(account);
+    AccountCredential* cached   = g_hash_table_lookup(plugin_credentials, account);
+
+    if((cached != NULL) && (strcmp(cached->protocol_id, id) == 0) && (strcmp(cached->username, un) == 0))
+        return cached;
+
+    // New account, renamed or protocol changed
+    AccountCredential* cred = g_new(AccountCredential, 1);
+    cred->account       = account;
+    cred->serial        = (cached != NULL) ? cached->serial : ++plugin_credential_serial;
+    cred->protocol_id   = g_strdup(id);
+    cred->username      = g_strdup(un);
+
+    cred->attributes    = g_hash_table_new(g_str_hash, g_str_equal);
+    g_hash_table_insert(cred->attributes, "program" , (gpointer*) SCHEMA_PROGRAM);
+    g_hash_table_insert(cred->attributes, "protocol" , (gpointer*) cred->protocol_id);
+    g_hash_table_insert(cred->attributes, "username" , (gpointer*) cred->username);
+
+    cred->legacy_attributes = g_hash_table_new(g_str_hash, g_str_equal);
+    g_hash_table_insert(cred->legacy_attributes, "protocol" , (gpointer*) cred->protocol_id);
+    g_hash_table_insert(cred->legacy_attributes, "username" , (gpointer*) cred->username);
+
+    cred->label         = g_strdup_printf("%s: Purple account password", purple_account_get_protocol_name(account));
+    cred->collection    = get_account_collection(account);
+
+    // Keyring item of the old name does not count for the new one
+    cred->keyring_digest    = NULL;
+    cred->pending_digest    = NULL;
+
+    // Items of the old name would be orphaned in the keyring. Renamed again
+    // before they were taken: the first name still holds them.
+    if(cached == NULL)
+        cred->rename = NULL;
+    else if(cached->rename != NULL)
+    {
+        cred->rename    = cached->rename;
+        cached->rename  = NULL;
+    }
+    else
+        cred->rename = rename_request_new(cached, cred);
+
+    g_hash_table_replace(plugin_credentials, account, cred);
+    return cred;
+}
+
+// Move the items of the old name once the account is used under the new one,
+// or delete them if its password goes away
+static void take_renamed_items(AccountCredential* cred, gboolean discard)
+{
+    RenameRequest* rename = cred->rename;
+    if(rename == NULL) return;
+
+    cred->rename    = NULL;
+    rename->discard = discard;
+    move_renamed_items(rename, NULL);
+    rename_request_free(rename);
+}
+
+/**************************************************
+ **************************************************
+ ***************** Degraded mode ******************
+ **************************************************
+ **************************************************/
+
+// While the keyring is unresponsive, loads are deferred instead of blocking
+// the client. A background probe leaves degraded mode and replays them.
+
+static void load_account_password(gpointer data, gpointer user_data);
+static void migrate_schema();
+static void broker_disconnect();
+
+static void defer_account_load(AccountCredential* cred)
+{
+    for(GList* li = plugin_deferred->head; li != NULL; li = li->next)
+    {
+        AccountRef* ref = li->data;
+        if((ref->account == cred->account) && (ref->serial == cred->serial)) return;
+    }
+
+    g_queue_push_tail(plugin_deferred, account_ref_new(cred));
+    purple_debug_info(PLUGIN_ID, "Deferred loading %s password with username %s\n", cred->protocol_id, cred->username);
+}
+
+// Load a deferred password and connect if libpurple would have done so. Also
+// used once a locked keyring is unlocked.
+static void load_deferred_account(PurpleAccount* account)
+{
+    load_account_password(account, NULL);
+
+    if((account->password != NULL) && (purple_account_get_enabled(account, purple_core_get_ui()))
+            && (purple_account_is_disconnected(account)) && (purple_presence_is_online(purple_account_get_presence(account))))
+    {
+        purple_request_close_with_handle(account);
+        purple_account_connect(account);
+    }
+}
+
+// Leave degraded mode and replay the deferred loads
+static void keyring_recovered()
+{
+    AccountRef* ref = NULL;
+
+    purple_debug_info(PLUGIN_ID, "Keyring responds again, leaving degraded mode. Loading %u deferred passwords\n", g_queue_get_length(plugin_deferred));
+    plugin_health = KEYRING_HEALTHY;
+    g_source_remove(plugin_retry_source);
+    plugin_retry_source = 0;
+
+    // A load may run into its deadline again and re-enter degraded mode
+    while((plugin_health == KEYRING_HEALTHY) && ((ref = g_queue_pop_head(plugin_deferred)) != NULL))
+    {
+        PurpleAccount* account = account_ref_get(ref);
+        account_ref_free(ref);
+
+        if(account != NULL) load_deferred_account(account);
+    }
+}
+
+static void on_keyring_probed(GObject* source,
+                    GAsyncResult* result,
+                    gpointer user_data)
+{
+    KeyringCall* call   = (KeyringCall*) user_data;
+    GError* error       = NULL;
+    GList* items        = secret_collection_search_finish(SECRET_COLLECTION(source), result, &error);
+    gboolean timed_out  = keyring_call_end(call, error);
+
+    g_list_free_full(items, g_object_unref);
+    plugin_probe_running = FALSE;
+
+    // Plugin was unloaded
+    if(plugin_deferred == NULL)
+    {
+        g_clear_error(&error);
+        return;
+    }
+
+    if(timed_out || (error != NULL))
+    {
+        purple_debug_info(PLUGIN_ID, "Keyring still unresponsive, %u passwords deferred\n", g_queue_get_length(plugin_deferred));
+        g_clear_error(&error);
+        return;
+    }
+
+    keyring_recovered();
+}
+
+// The connect on plugin load ran into its deadline
+static void on_service_probed(GObject* source,
+                    GAsyncResult* result,
+                    gpointer user_data)
+{
+    KeyringCall* call       = (KeyringCall*) user_data;
+    GError* error           = NULL;
+    SecretService* service  = secret_service_get_finish(result, &error);
+    gboolean timed_out      = keyring_call_end(call, error);
+
+    plugin_probe_running = FALSE;
+
+    // Plugin was unloaded
+    if(plugin_deferred == NULL)
+    {
+        g_clear_error(&error);
+        if(service != NULL) g_object_unref(service);
+        return;
+    }
+
+    if(timed_out || (error != NULL))
+    {
+        purple_debug_info(PLUGIN_ID, "Keyring still unreachable, %u passwords deferred\n", g_queue_get_length(plugin_deferred));
+        g_clear_error(&error);
+        return;
+    }
+
+    // Credentials already point to the registered keyrings
+    plugin_service = service;
+    connect_collections();
+    migrate_schema();
+    keyring_recovered();
+}
+
+// The broker probes the keyring once for all instances
+static void on_broker_pinged(GObject* source,
+                    GAsyncResult* result,
+                    gpointer user_data)
+{
+    KeyringCall* call       = (KeyringCall*) user_data;
+    GError* error           = NULL;
+    gboolean responsive     = FALSE;
+    GVariant* reply         = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &error);
+    gboolean timed_out      = keyring_call_end(call, error);
+
+    plugin_probe_running = FALSE;
+
+    if(reply != NULL)
+    {
+        g_variant_get(reply, "(b)", &responsive);
+        g_variant_unref(reply);
+    }
+
+    // Plugin was unloaded
+    if(plugin_deferred == NULL)
+    {
+        g_clear_error(&error);
+        return;
+    }
+
+    // Broker is gone, the next probe asks the keyring directly
+    if((error != NULL) && (!timed_out))
+    {
+        purple_debug_warning(PLUGIN_ID, "Credential broker ping failed: %s. Using the keyring directly\n", error->message);
+        g_error_free(error);
+        broker_disconnect();
+        migrate_schema();
+        return;
+    }
+
+    if(timed_out || (!responsive))
+    {
+        purple_debug_info(PLUGIN_ID, "Keyring still unresponsive, %u passwords deferred\n", g_queue_get_length(plugin_deferred));
+        g_clear_error(&error);
+        return;
+    }
+
+    keyring_recovered();
+}
+
+// Cheap search with a deadline, no secrets and no prompts. Connects first if
+// the keyring did not answer on plugin load, asks the broker if it is running.
+static gboolean probe_keyring(gpointer data)
+{
+    if(plugin_probe_running) return G_SOURCE_CONTINUE;
+
+    if((plugin_broker != NULL) && (plugin_service != NULL))
+    {
+        KeyringCall* call       = keyring_call_begin("broker ping", call_timeout());
+        plugin_probe_running    = TRUE;
+
+        g_dbus_connection_call(plugin_broker,
+                NULL,
+                BROKER_OBJECT_PATH,
+                BROKER_INTERFACE,
+                "Ping",
+                NULL,
+                G_VARIANT_TYPE("(b)"),
+                G_DBUS_CALL_FLAGS_NONE,
+                -1,
+                call->cancellable,
+                on_broker_pinged,
+                call);
+
+        return G_SOURCE_CONTINUE;
+    }
+
+    if(plugin_service == NULL)
+    {
+        KeyringCall* call       = keyring_call_begin("connect", call_timeout());
+        plugin_probe_running    = TRUE;
+
+        secret_service_get(SECRET_SERVICE_OPEN_SESSION | SECRET_SERVICE_LOAD_COLLECTIONS, call->cancellable, on_service_probed, call);
+        return G_SOURCE_CONTINUE;
+    }
+
+    for(GList* li = plugin_collections; li != NULL; li = li->next)
+    {
+        KeyringCollection* kc = li->data;
+        if(kc->collection == NULL) continue;
+
+        GHashTable* attributes  = g_hash_table_new(g_str_hash, g_str_equal);
+        KeyringCall* call       = keyring_call_begin("probe", call_timeout());
+        g_hash_table_insert(attributes, "program" , (gpointer*) SCHEMA_PROGRAM);
+
+        plugin_probe_running = TRUE;
+        secret_collection_search(kc->collection,
+                PURPLE_SCHEMA,
+                attributes,
+                SECRET_SEARCH_NONE,
+                call->cancellable,
+                on_keyring_probed,
+                call);
+
+        g_hash_table_destroy(attributes);
+        break;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void keyring_degrade()
+{
+    if(plugin_health == KEYRING_DEGRADED) return;
+
+    purple_debug_warning(PLUGIN_ID, "Keyring does not respond in time, switching to degraded mode\n");
+    plugin_health       = KEYRING_DEGRADED;
+    plugin_retry_source = g_timeout_add_seconds(KEYRING_RETRY_INTERVAL, probe_keyring, NULL);
+}
+
+// Deadline passed: defer the load and stop blocking on the keyring
+static void load_timed_out(AccountCredential* cred, GError** error)
+{
+    g_clear_error(error);
+    keyring_degrade();
+    defer_account_load(cred);
+}
+
+/**************************************************
+ **************************************************
+ ************ Store password pipline **************
+ **************************************************
+ **************************************************/
+
+// Error check
+static void on_item_created(GObject* source,
+                    GAsyncResult* result,
+                    gpointer user_data)
+{
+    StoreRequest* request   = (StoreRequest*) user_data;
+    PurpleAccount* account  = account_ref_get(request->account);
+    GError* error           = NULL;
+    SecretItem* item        = secret_item_create_finish(result, &error);
+    gboolean timed_out      = keyring_call_end(request->call, error);
+    purple_debug_info(PLUGIN_ID, "Debug info. Finished storing password\n" );
+
+    plugin_copies = &request->copies;
+
+    if (account != NULL)
+    {
+        AccountCredential* cred = g_hash_table_lookup(plugin_credentials, account);
+
+        if(g_strcmp0(cred->pending_digest, request->digest) == 0)
+        {
+            secret_password_free(cred->pending_digest);
+            cred->pending_digest = NULL;
+        }
+
+        if(error == NULL)
+        {
+            secret_password_free(cred->keyring_digest);
+            cred->keyring_digest = g_strdup(request->digest);
+            COUNT_COPY(digests);
+        }
+    }
+
+    plugin_copies = NULL;
+    report_secret_copies("Storing", request->account->protocol_id, &request->copies);
+
+    account_ref_free(request->account);
+    secret_password_free(request->digest);
+    g_free(request);
+
+    if (account == NULL)
+    {
+        purple_debug_info(PLUGIN_ID, "Account was removed while storing its password\n");
+        if(error != NULL) g_error_free(error);
+        if(item != NULL) g_object_unref(item);
+    }
+    else if (timed_out)
+    {
+        // Digest stays unchanged, so the next connect writes through again
+        purple_debug_warning(PLUGIN_ID, "Storing %s password with username %s timed out\n", account->protocol_id, account->username);
+        g_error_free(error);
+        keyring_degrade();
+    }
+    else if (error != NULL)
+    {
+        print_protocol_error_message(purple_account_get_protocol_name(account), "Error saving passwort to keyring", error);
+    }
+    else
+    {
+        if(account->password != NULL)
+        {
+            account_clear_password(account);
+            purple_debug_info(PLUGIN_ID, "Cleared password for %s with username %s\n", account->protocol_id, account->username);
+        }
+
+        purple_debug_info(PLUGIN_ID, "%s password successfully saved for %s\n", account->protocol_id, account->username);
+        purple_account_set_remember_password(account, FALSE);
+        g_object_unref(item);
+    }
+
+    /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
+}
+
+// Store password in the keyring
+static void store_account_password(gpointer data, gpointer user_data)
+{
+    PurpleAccount* account  = (PurpleAccount*) data;
+    AccountCredential* cred = get_account_credential(account);
+
+    take_renamed_items(cred, FALSE);
+    if(!collection_ready(cred, store_account_password)) return;
+
+    const gchar* password = purple_account_get_password(account);
+    if(password == NULL)
+    {
+        purple_debug_info(PLUGIN_ID, "No %s password to store for username %s\n", account->protocol_id, account->username);
+        return;
+    }
+
+    StoreRequest* request   = g_new0(StoreRequest, 1);
+    plugin_copies           = &request->copies;
+
+    // Single copy in secure memory, the account copy is wiped once stored
+    SecretValue* value = secret_value_new(password, -1, "text/plain");
+    COUNT_COPY(secure);
+
+    request->account        = account_ref_new(cred);
+    request->digest         = password_digest(password);
+    request->call           = keyring_call_begin("store", call_timeout());
+
+    secret_password_free(cred->pending_digest);
+    cred->pending_digest    = g_strdup(request->digest);
+    COUNT_COPY(digests);
+
+    purple_debug_info(PLUGIN_ID, "Debug info. Storing %s password with username %s\n", account->protocol_id, account->username);
+    secret_item_create(cred->collection->collection,
+            PURPLE_SCHEMA,
+            cred->attributes,
+            cred->label,
+            value,
+            SECRET_ITEM_CREATE_REPLACE,
+            request->call->cancellable,
+            on_item_created,
+            request
+            );
+
+    // CreateItem request
+    COUNT_COPY(messages);
+    plugin_copies = NULL;
+    secret_value_unref(value);
+
+}
+
+/**************************************************
+ **************************************************
+ *************** Credential broker ****************
+ **************************************************
+ **************************************************/
+
+// Optional helper which serves all messenger instances of the user from one
+// keyring session, see purple-gnome-keyring-broker.c. Whenever it fails the
+// password is loaded from the keyring directly.
+
+static void broker_connect()
+{
+    if(!purple_prefs_get_bool(KEYRING_BROKER_PREF)) return;
+
+    gchar* path         = broker_socket_path();
+    gchar* escaped      = g_dbus_address_escape_value(path);
+    gchar* address      = g_strdup_printf("unix:path=%s", escaped);
+    GError* error       = NULL;
+    KeyringCall* call   = keyring_call_begin("broker connect", call_timeout());
+
+    plugin_broker = g_dbus_connection_new_for_address_sync(address,
+            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+            NULL,
+            call->cancellable,
+            &error);
+
+    keyring_call_end(call, error);
+
+    if(error != NULL)
+    {
+        purple_debug_info(PLUGIN_ID, "Credential broker not available at %s: %s. Using the keyring directly\n", path, error->message);
+        g_error_free(error);
+    }
+    else
+    {
+        purple_debug_info(PLUGIN_ID, "Using credential broker at %s\n", path);
+        g_dbus_connection_add_filter(plugin_broker, count_dbus_call, NULL, NULL);
+        plugin_broker_timeouts = 0;
+    }
+
+    g_free(address);
+    g_free(escaped);
+    g_free(path);
+}
+
+static void broker_disconnect()
+{
+    if(plugin_broker == NULL) return;
+
+    g_dbus_connection_close_sync(plugin_broker, NULL, NULL);
+    g_object_unref(plugin_broker);
+    plugin_broker = NULL;
+}
+
+// FALSE if the broker cannot answer and the keyring has to be searched directly
+static gboolean broker_load_password(AccountCredential* cred)
+{
+    // Broker migrates legacy items before it indexes a keyring
+    if(plugin_broker == NULL) return FALSE;
+
+    PurpleAccount* account  = cred->account;
+    GError* error           = NULL;
+    guint32 status          = BROKER_UNAVAILABLE;
+    const gchar* path       = NULL;
+    KeyringCall* call       = keyring_call_begin("broker lookup", call_timeout());
+
+    GVariant* reply = g_dbus_connection_call_sync(plugin_broker,
+            NULL,
+            BROKER_OBJECT_PATH,
+            BROKER_INTERFACE,
+            "Lookup",
+            g_variant_new("(sss)", g_dbus_proxy_get_object_path(G_DBUS_PROXY(cred->collection->collection)), cred->protocol_id, cred->username),
+            G_VARIANT_TYPE("(uo)"),
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            call->cancellable,
+            &error);
+
+    gboolean timed_out = keyring_call_end(call, error);
+
+    // A busy keyring can delay a single lookup, the keyring is searched directly this time
+    if(timed_out && (++plugin_broker_timeouts < BROKER_MAX_TIMEOUTS))
+    {
+        purple_debug_info(PLUGIN_ID, "Credential broker lookup timed out (%u in a row). Searching the keyring directly\n", plugin_broker_timeouts);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    if(error != NULL)
+    {
+        // Broker is gone or hangs, do not ask it again until the next plugin load
+        purple_debug_warning(PLUGIN_ID, "Credential broker lookup failed: %s. Using the keyring directly\n", error->message);
+        g_error_free(error);
+        broker_disconnect();
+        migrate_schema();
+        return FALSE;
+    }
+
+    plugin_broker_timeouts = 0;
+    g_variant_get(reply, "(u&o)", &status, &path);
+
+    // Broker only knows the item, the secret is read through our own session
+    if(status == BROKER_FOUND)
+    {
+        call                = keyring_call_begin("secret", call_timeout());
+        SecretValue* value  = load_path_secret(path, call->cancellable, &error);
+
+        if(keyring_call_end(call, error))
+        {
+            load_timed_out(cred, &error);
+        }
+        else if((error != NULL) || (value == NULL))
+        {
+            // Item went away since the broker indexed it
+            purple_debug_info(PLUGIN_ID, "Could not read broker item %s: %s. Searching the keyring directly\n", path, (error != NULL) ? error->message : "no secret");
+            g_clear_error(&error);
+            status = BROKER_UNAVAILABLE;
+        }
+        else
+        {
+            account_set_password(account, secret_value_get_text(value));
+            set_keyring_digest(cred, secret_value_get_text(value));
+            secret_value_unref(value);
+        }
+    }
+    else if(status == BROKER_NOT_FOUND)
+    {
+        purple_debug_info(PLUGIN_ID, "%s: Password is empty - no password saved", account->protocol_id);
+    }
+
+    g_variant_unref(reply);
+    return status != BROKER_UNAVAILABLE;
+}
+
+/**************************************************
+ **************************************************
+ ************* Load password pipline **************
+ **************************************************
+ **************************************************/
+
+// libpurple connects right after account-enabled and asks for the password
+// while the unlock prompt is still open. Once the keyring is unlocked the
+// password is loaded, the request closed and the account connected.
+static void load_unlocked_account(gpointer data, gpointer user_data)
+{
+    load_deferred_account((PurpleAccount*) data);
+}
+
+// Search the keyring without the broker
+static void load_keyring_password(AccountCredential* cred)
+{
+    PurpleAccount* account  = cred->account;
+    KeyringCollection* kc   = cred->collection;
+
+    purple_debug_info(PLUGIN_ID, "Debug info. Loading password %s with username %s\n", account->protocol_id, account->username);
+    // Make in synchronously to prevent asks for password dialogs
+    GError* error       = NULL;
+    KeyringCall* call   = keyring_call_begin("search", call_timeout());
+
+    // Secrets are not loaded here, only the one in use is read below
+    GList* items = secret_collection_search_sync(kc->collection,
+            PURPLE_SCHEMA,
+            cred->attributes,
+            SECRET_SEARCH_ALL,
+            call->cancellable,
+            &error);
+
+    // Item may not be migrated yet
+    if((error == NULL) && (items == NULL) && (!kc->migrated))
+    {
+        items = secret_collection_search_sync(kc->collection,
+                LEGACY_SCHEMA,
+                cred->legacy_attributes,
+                SECRET_SEARCH_ALL,
+                call->cancellable,
+                &error);
+    }
+
+    if (keyring_call_end(call, error))
+    {
+        load_timed_out(cred, &error);
+    }
+    else if (error != NULL)
+    {
+        print_protocol_error_message(purple_account_get_protocol_name(account), "Could not read password", error);
+    }
+    else if (items == NULL)
+    {
+        purple_debug_info(PLUGIN_ID, "%s: Password is empty - no password saved", account->protocol_id);
+        /* print_protocol_info_message(purple_account_get_protocol_name(account), "Password is empty or no password given"); */
+    }
+    else
+    {
+        call                = keyring_call_begin("secret", call_timeout());
+        SecretValue* value  = load_item_secret(get_newest_item(items), call->cancellable, &error);
+
+        if(keyring_call_end(call, error))
+        {
+            load_timed_out(cred, &error);
+        }
+        else if(error != NULL)
+        {
+            print_protocol_error_message(purple_account_get_protocol_name(account), "Could not read password", error);
+        }
+        else if(value != NULL)
+        {
+            account_set_password(account, secret_value_get_text(value));
+            set_keyring_digest(cred, secret_value_get_text(value));
+            secret_value_unref(value);
+        }
+
+        g_list_free_full(items, g_object_unref);
+    }
+}
+
+static void load_account_password(gpointer data, gpointer user_data)
+{
+    PurpleAccount* account = (PurpleAccount*) data;
+
+    if(!purple_account_get_remember_password(account))
+    {
+
+        AccountCredential* cred = get_account_credential(account);
+        SecretCopies copies     = {0, 0, 0, 0};
+
+        take_renamed_items(cred, FALSE);
+
+        // Keyring is slow, do not block on it
+        if(plugin_health == KEYRING_DEGRADED)
+        {
+            defer_account_load(cred);
+            return;
+        }
+
+        // Locked keyring is unlocked in the background, the load runs once the prompt is answered
+        if(!collection_ready(cred, load_unlocked_account)) return;
+
+        plugin_copies = &copies;
+        if(!broker_load_password(cred)) load_keyring_password(cred);
+        plugin_copies = NULL;
+
+        report_secret_copies("Loading", cred->protocol_id, &copies);
+
+        /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
+
+    }
+
+}
+
+/**************************************************
+ **************************************************
+ ************ Delete password pipline *************
+ **************************************************
+ **************************************************/
+
+// Deleted callback
+static void on_password_deleted(GObject* source,
+                    GAsyncResult* result,
+                    gpointer user_data)
+{
+
+    AccountRef* ref     = (AccountRef*) user_data;
+    GError* error       = NULL;
+    gboolean success    = secret_item_delete_finish(SECRET_ITEM(source), result, &error);
+
+    if(error != NULL)
+    {
+        print_protocol_error_message(ref->protocol_id, "Could not delete password.", error);
+    }
+    else
+    {
+        if(success) purple_debug_info(PLUGIN_ID, "Successfully deteted password for %s", ref->protocol_id);
+        else  purple_debug_info(PLUGIN_ID, "Could not detete password for %s, but no error occured", ref->protocol_id);
+    }
+
+    account_ref_free(ref);
+
+    /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
+}
+
+// Delete from collection
+static void delete_collection_password(GObject* source,
+                    GAsyncResult* result,
+                    gpointer user_data)
+{
+
+    AccountRef* ref         = (AccountRef*) user_data;
+    PurpleAccount* account  = account_ref_get(ref);     // NULL for removed accounts
+    GError* error   = NULL;
+    GList* items    = secret_collection_search_finish(SECRET_COLLECTION(source), result, &error);
+
+    if(error != NULL)
+    {
+        print_protocol_error_message(ref->protocol_id, "Could not delete password", error);
+    }
+    else if (items == NULL)
+    {
+        purple_debug_info(PLUGIN_ID, "%s: No password found for deletion", ref->protocol_id);
+        /* print_protocol_info_message(purple_account_get_protocol_name(account), "Password is empty or no password given"); */
+    }
+    else
+    {
+            // Keep the password usable for the account, but do not write it back.
+            // Removed accounts need no copy.
+            if(account != NULL)
+            {
+                KeyringCall* call   = keyring_call_begin("secret", call_timeout());
+                SecretValue* value  = load_item_secret(get_newest_item(items), call->cancellable, &error);
+
+                if(keyring_call_end(call, error)) keyring_degrade();
+
+                if(value != NULL)
+                {
+                    account_set_password(account, secret_value_get_text(value));
+                    set_keyring_digest(g_hash_table_lookup(plugin_credentials, account), secret_value_get_text(value));
+                    secret_value_unref(value);
+                }
+            }
+
+            // Keep the item rather than lose the only copy of the password
+            if(error != NULL)
+            {
+                print_protocol_error_message(ref->protocol_id, "Could not delete password", error);
+            }
+            else
+            {
+                // Duplicates go as well
+                for(GList* li = items; li != NULL; li = li->next)
+                    secret_item_delete(li->data, NULL, on_password_deleted, account_ref_copy(ref));
+            }
+
+            g_list_free_full(items, g_object_unref);
+
+    }
+
+    account_ref_free(ref);
+
+}
+
+// Search the items of cred, deletion continues in delete_collection_password
+static void delete_credential_password(gpointer data, gpointer user_data)
+{
+    AccountCredential* cred = (AccountCredential*) data;
+
+    secret_collection_search(cred->collection->collection,
+            PURPLE_SCHEMA,
+            cred->attributes,
+            SECRET_SEARCH_ALL,
+            NULL,
+            delete_collection_password,
+            account_ref_new(cred));
+
+    // Item may not be migrated yet
+    if(!cred->collection->migrated)
+    {
+        secret_collection_search(cred->collection->collection,
+                LEGACY_SCHEMA,
+                cred->legacy_attributes,
+                SECRET_SEARCH_ALL,
+                NULL,
+                delete_collection_password,
+                account_ref_new(cred));
+    }
+}
+
+// Delete password function
+static void delete_account_password(gpointer data, gpointer user_data)
+{
+    PurpleAccount* account  = (PurpleAccount*) data;
+    AccountCredential* cred = get_account_credential(account);
+
+    take_renamed_items(cred, TRUE);
+    purple_account_set_remember_password(account, FALSE);
+    if(!collection_ready(cred, delete_account_password)) return;
+
+    delete_credential_password(cred, NULL);
+}
+
+// The account is freed right after account-removed, so its credential is
+// taken over and kept until the delete was issued
+static void delete_removed_account_password(PurpleAccount* account)
+{
+    AccountCredential* cred = get_account_credential(account);
+    KeyringCollection* kc   = cred->collection;
+
+    take_renamed_items(cred, TRUE);
+    g_hash_table_steal(plugin_credentials, account);
+
+    if((kc == NULL) || (kc->collection == NULL))
+    {
+        purple_debug_info(PLUGIN_ID, "No keyring available for %s with username %s\n", cred->protocol_id, cred->username);
+        account_credential_free(cred);
+        return;
+    }
+
+    update_collection_state(kc);
+
+    if(kc->state == COLLECTION_UNLOCKED)
+    {
+        delete_credential_password(cred, NULL);
+        account_credential_free(cred);
+    }
+    else
+        queue_operation(kc, delete_credential_password, cred, (GDestroyNotify) account_credential_free, NULL);
+}
+
+/**************************************************
+ **************************************************
+ ************* Rename password pipline ************
+ **************************************************
+ **************************************************/
 
-        g_list_free(locked_collections);
+// Same keyring: the attributes are rewritten in place. Other keyring, e.g.
+// the new name matches another route: the secret is copied over and the
+// items of the old name are deleted once the copy exists. If the new name
+// already has a password, stored or in flight, the items of the old name are
+// outdated and deleted. Moving them would make them the newest item.
 
-    }
+// A store of the new name is in flight or done
+static gboolean renamed_password_stored(AccountCredential* cred)
+{
+    return (cred->pending_digest != NULL) || (cred->keyring_digest != NULL);
+}
 
-    return was_locked;
+// Frees request
+static void delete_renamed_items(RenameRequest* request)
+{
+    for(GList* li = request->items; li != NULL; li = li->next)
+        secret_item_delete(li->data, NULL, on_password_deleted, account_ref_copy(request->account));
 
+    rename_request_free(request);
 }
 
+static void on_item_renamed(GObject* source,
+                    GAsyncResult* result,
+                    gpointer user_data)
+{
+    AccountRef* ref = (AccountRef*) user_data;
+    GError* error   = NULL;
+
+    if(secret_item_set_attributes_finish(SECRET_ITEM(source), result, &error))
+        purple_debug_info(PLUGIN_ID, "Moved %s password to the new username\n", ref->protocol_id);
+    else
+        print_protocol_error_message(ref->protocol_id, "Could not move password to the new username", error);
 
-// Init collection
-static void init_collection()
+    account_ref_free(ref);
+}
+
+static void on_renamed_item_created(GObject* source,
+                    GAsyncResult* result,
+                    gpointer user_data)
 {
-    GError* error = NULL;
-    SecretService* service = secret_service_get_sync(SECRET_SERVICE_OPEN_SESSION | SECRET_SERVICE_LOAD_COLLECTIONS, NULL, &error);
+    RenameRequest* request  = (RenameRequest*) user_data;
+    GError* error           = NULL;
+    SecretItem* item        = secret_item_create_finish(result, &error);
 
     if(error != NULL)
     {
-        dialog( PURPLE_NOTIFY_MSG_ERROR, "Could not connect to the Gnome Keyring.", error->message);
-        g_error_free(error);
+        print_protocol_error_message(request->account->protocol_id, "Could not move password to the new username", error);
+        rename_request_free(request);
+        return;
     }
-    else
-    {
-        plugin_service = service;
-        SecretCollection* collection = get_collection(service);
-
-        if(collection != NULL)
-        {
-            plugin_collection = collection;
-        }
-        else
-            dialog( PURPLE_NOTIFY_MSG_ERROR, "Could not load collection.", NULL);
 
-        g_object_unref(collection);
+    purple_debug_info(PLUGIN_ID, "Copied %s password to the keyring of the new username\n", request->account->protocol_id);
+    g_object_unref(item);
+    delete_renamed_items(request);
+}
 
+static void on_renamed_secret_loaded(GObject* source,
+                    GAsyncResult* result,
+                    gpointer user_data)
+{
+    RenameRequest* request  = (RenameRequest*) user_data;
+    PurpleAccount* account  = account_ref_get(request->account);
+    GError* error           = NULL;
+    SecretValue* value      = secret_service_get_secret_for_dbus_path_finish(SECRET_SERVICE(source), result, &error);
+    AccountCredential* cred = (account != NULL) ? g_hash_table_lookup(plugin_credentials, account) : NULL;
 
+    if(error != NULL)
+    {
+        print_protocol_error_message(request->account->protocol_id, "Could not move password to the new username", error);
+    }
+    else if((cred != NULL) && renamed_password_stored(cred))
+    {
+        // Stored while the secret was read
+        if(value != NULL) secret_value_unref(value);
+        delete_renamed_items(request);
+        return;
     }
+    else if((cred != NULL) && (value != NULL))
+    {
+        secret_item_create(cred->collection->collection,
+                PURPLE_SCHEMA,
+                cred->attributes,
+                cred->label,
+                value,
+                SECRET_ITEM_CREATE_REPLACE,
+                NULL,
+                on_renamed_item_created,
+                request);
 
-    g_object_unref(service);
+        secret_value_unref(value);
+        return;
+    }
 
+    if(value != NULL) secret_value_unref(value);
+    rename_request_free(request);
 }
 
-/**************************************************
- **************************************************
- ************ Store password pipline **************
- **************************************************
- **************************************************/
-
-// Error check
-static void on_item_created(GObject* source,
+// Items of the old name are known, the new name is searched. A store started
+// meanwhile is sent after the move, so it replaces the moved item.
+static void on_renamed_target_found(GObject* source,
                     GAsyncResult* result,
                     gpointer user_data)
 {
-    PurpleAccount* account  = (PurpleAccount*) user_data;
+    RenameRequest* request  = (RenameRequest*) user_data;
     GError* error           = NULL;
-    SecretItem* item        = secret_item_create_finish(result, &error);
-    purple_debug_info(PLUGIN_ID, "Debug info. Finished storing password\n" );
+    GList* items            = secret_collection_search_finish(SECRET_COLLECTION(source), result, &error);
+    gboolean exists         = (items != NULL);
+    PurpleAccount* account  = account_ref_get(request->account);
 
-    if (error != NULL)
+    g_list_free_full(items, g_object_unref);
+
+    // Plugin was unloaded or the account removed meanwhile
+    if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED) || (account == NULL))
     {
-        print_protocol_error_message(purple_account_get_protocol_name(account), "Error saving passwort to keyring", error);
+        g_clear_error(&error);
+        rename_request_free(request);
+        return;
     }
-    else
-    {
-        if(account->password != NULL)
-        {
-            purple_account_set_password(account, "Lorem ipsum dolor sit amet, consectetur adipiscing elit. Cras eu semper eros. Donec non gravida mi. Vestibulum ante ipsum primis in faucibus orci luctus et ultrices posuere cubilia Curae; Phasellus malesuada nisl eget est elementum, in ullamcorper nullam.");
 
-            g_free(account->password);
-            account->password = NULL;
+    // Keep the items of the old name rather than lose a password
+    if(error != NULL)
+    {
+        print_protocol_error_message(request->account->protocol_id, "Could not move password to the new username", error);
+        rename_request_free(request);
+        return;
+    }
 
-            purple_debug_info(PLUGIN_ID, "Cleared password for %s with username %s\n", account->protocol_id, account->username);
-        }
+    AccountCredential* cred = g_hash_table_lookup(plugin_credentials, account);
+    SecretItem* newest      = get_newest_item(request->items);
 
-        purple_debug_info(PLUGIN_ID, "%s password successfully saved for %s\n", account->protocol_id, account->username);
-        purple_account_set_remember_password(account, FALSE);
-        g_object_unref(item);
+    if(exists || renamed_password_stored(cred))
+    {
+        purple_debug_info(PLUGIN_ID, "%s password of username %s is already stored, deleting the items of the old name\n", cred->protocol_id, cred->username);
+        delete_renamed_items(request);
     }
+    else if(cred->collection == request->from)
+    {
+        secret_item_set_attributes(newest, PURPLE_SCHEMA, cred->attributes, NULL, on_item_renamed, account_ref_copy(request->account));
 
-    /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
+        // Duplicates of the old name go
+        request->items = g_list_remove(request->items, newest);
+        g_object_unref(newest);
+        delete_renamed_items(request);
+    }
+    else
+    {
+        secret_service_get_secret_for_dbus_path(plugin_service,
+                g_dbus_proxy_get_object_path(G_DBUS_PROXY(newest)),
+                NULL,
+                on_renamed_secret_loaded,
+                request);
+    }
 }
 
-// Store password in the keyring
-static void store_account_password(gpointer data, gpointer user_data)
+static void on_renamed_items_found(GObject* source,
+                    GAsyncResult* result,
+                    gpointer user_data)
 {
-    unlock_collection();
-    PurpleAccount* account = (PurpleAccount*) data;
-    GHashTable* attributes = get_attributes(account);
-    gchar label[255] = purple_account_get_protocol_name(account);
-    strcat(label, ": Purple account password");
-
-    purple_debug_info(PLUGIN_ID, "Debug info. Storing %s password with username %s\n", account->protocol_id, account->username);
-    secret_item_create(plugin_collection,
-            PURPLE_SCHEMA,
-            attributes,
-            label,
-            secret_value_new(purple_account_get_password(account), -1, "text/plain"),
-            SECRET_ITEM_CREATE_REPLACE,
-            NULL,
-            on_item_created,
-            account
-            );
+    RenameRequest* request  = (RenameRequest*) user_data;
+    GError* error           = NULL;
+    GList* items            = secret_collection_search_finish(SECRET_COLLECTION(source), result, &error);
 
-    g_hash_table_destroy(attributes);
+    // Plugin was unloaded
+    if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        g_clear_error(&error);
+        g_list_free_full(items, g_object_unref);
+        rename_request_free(request);
+        return;
+    }
 
-}
+    if(error != NULL)
+    {
+        print_protocol_error_message(request->account->protocol_id, "Could not move password to the new username", error);
+        rename_request_free(request);
+        return;
+    }
 
-/**************************************************
- **************************************************
- ************* Load password pipline **************
- **************************************************
- **************************************************/
+    request->items = items;
 
-static void load_account_password(gpointer data, gpointer user_data)
-{
-    PurpleAccount* account = (PurpleAccount*) data;
+    if(items == NULL)
+    {
+        rename_request_free(request);
+        return;
+    }
 
-    if(!purple_account_get_remember_password(account))
+    // Password of a removed account or deleted by the user
+    if(request->discard)
     {
+        delete_renamed_items(request);
+        return;
+    }
 
-        unlock_collection();
-        GHashTable* attributes = get_attributes(account);
-        purple_debug_info(PLUGIN_ID, "Debug info. Loading password %s with username %s\n", account->protocol_id, account->username);
-        // Make in synchronously to prevent asks for password dialogs
-        GError* error   = NULL;
+    PurpleAccount* account  = account_ref_get(request->account);
+    AccountCredential* cred = (account != NULL) ? g_hash_table_lookup(plugin_credentials, account) : NULL;
 
-        GList* items = secret_collection_search_sync(plugin_collection,
+    if(cred == NULL)
+    {
+        rename_request_free(request);
+    }
+    else if(renamed_password_stored(cred))
+    {
+        purple_debug_info(PLUGIN_ID, "%s password of username %s is already stored, deleting the items of the old name\n", cred->protocol_id, cred->username);
+        delete_renamed_items(request);
+    }
+    else
+    {
+        // E.g. stored by another messenger instance
+        secret_collection_search(cred->collection->collection,
                 PURPLE_SCHEMA,
-                attributes,
-                SECRET_SEARCH_LOAD_SECRETS,
-                NULL,
-                &error);
+                cred->attributes,
+                SECRET_SEARCH_NONE,
+                cred->collection->cancellable,
+                on_renamed_target_found,
+                request);
+    }
+}
 
-        if (error != NULL)
-        {
-            print_protocol_error_message(purple_account_get_protocol_name(account), "Could not read password", error);
-            g_error_free(error);
-        }
-        else if (items == NULL)
-        {
-            purple_debug_info(PLUGIN_ID, "%s: Password is empty - no password saved", account->protocol_id);
-            /* print_protocol_info_message(purple_account_get_protocol_name(account), "Password is empty or no password given"); */
-        }
-        else
-        {
-            SecretItem* item    = items->data;
-            SecretValue* value  = secret_item_get_secret(item);
+// Both keyrings must be unlocked, discarded items only need the keyring of
+// the old name. data stays owned by the caller.
+static void move_renamed_items(gpointer data, gpointer user_data)
+{
+    RenameRequest* request  = (RenameRequest*) data;
+    KeyringCollection* from = request->from;
+    KeyringCollection* to   = NULL;
 
-            purple_account_set_password(account, secret_value_get_text(value));
+    if(!request->discard)
+    {
+        PurpleAccount* account = account_ref_get(request->account);
+        if(account == NULL) return;
 
-            secret_value_unref(value);
-            g_object_unref(item);
-            g_list_free(items);
-        }
+        AccountCredential* cred = g_hash_table_lookup(plugin_credentials, account);
+        to                      = cred->collection;
 
-        g_hash_table_destroy(attributes);
-        /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
+        if((to == NULL) || (to->collection == NULL))
+        {
+            purple_debug_info(PLUGIN_ID, "No keyring available for %s with username %s, keeping the item of the old name\n", cred->protocol_id, cred->username);
+            return;
+        }
 
+        update_collection_state(to);
     }
 
+    update_collection_state(from);
+
+    if(from->state != COLLECTION_UNLOCKED)
+        queue_operation(from, move_renamed_items, rename_request_copy(request), (GDestroyNotify) rename_request_free, NULL);
+    else if((to != NULL) && (to->state != COLLECTION_UNLOCKED))
+        queue_operation(to, move_renamed_items, rename_request_copy(request), (GDestroyNotify) rename_request_free, NULL);
+    else
+        secret_collection_search(from->collection,
+                PURPLE_SCHEMA,
+                request->attributes,
+                SECRET_SEARCH_ALL,
+                from->cancellable,
+                on_renamed_items_found,
+                rename_request_copy(request));
 }
 
 /**************************************************
  **************************************************
- ************ Delete password pipline *************
+ **************** Schema migration ****************
  **************************************************
  **************************************************/
 
-// Deleted callback
-static void on_password_deleted(GObject* source,
+// Remember the keyring once all of its legacy items are rewritten
+static void collection_migrated(KeyringCollection* kc)
+{
+    if(kc->migration_failed)
+    {
+        purple_debug_warning(PLUGIN_ID, "Migration of keyring %s incomplete, retrying on next load\n", keyring_collection_name(kc));
+        return;
+    }
+
+    GList* paths = purple_prefs_get_string_list(KEYRING_MIGRATED_PREF);
+    paths = g_list_append(paths, g_strdup(g_dbus_proxy_get_object_path(G_DBUS_PROXY(kc->collection))));
+    purple_prefs_set_string_list(KEYRING_MIGRATED_PREF, paths);
+    g_list_free_full(paths, g_free);
+
+    kc->migrated = TRUE;
+    purple_debug_info(PLUGIN_ID, "Keyring %s migrated to schema version %i\n", keyring_collection_name(kc), SCHEMA_VERSION);
+}
+
+static void on_item_migrated(GObject* source,
                     GAsyncResult* result,
                     gpointer user_data)
 {
+    GError* error = NULL;
+    secret_item_set_attributes_finish(SECRET_ITEM(source), result, &error);
 
-    PurpleAccount* account  = (PurpleAccount*) user_data;
-    GError* error       = NULL;
-    gboolean success    = secret_item_delete_finish(SECRET_ITEM(source), result, &error);
-
-    if(error != NULL)
+    // Plugin was unloaded, user_data is gone
+    if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
     {
-        print_protocol_error_message(account->protocol_id, "Could not delete password.", error);
         g_error_free(error);
+        return;
     }
-    else
+
+    KeyringCollection* kc = (KeyringCollection*) user_data;
+
+    if(error != NULL)
     {
-        if(success) purple_debug_info(PLUGIN_ID, "Successfully deteted password for %s", account->protocol_id);
-        else  purple_debug_info(PLUGIN_ID, "Could not detete password for %s, but no error occured", account->protocol_id);
+        purple_debug_warning(PLUGIN_ID, "Could not migrate item in keyring %s: %s\n", keyring_collection_name(kc), error->message);
+        g_error_free(error);
+        kc->migration_failed = TRUE;
     }
 
-    /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
+    if(--kc->migrating == 0) collection_migrated(kc);
 }
 
-// Delete from collection
-static void delete_collection_password(GObject* source,
+// Rewrite all legacy items at once, secrets and labels stay untouched
+static void on_legacy_items_found(GObject* source,
                     GAsyncResult* result,
                     gpointer user_data)
 {
-
-    PurpleAccount* account  = (PurpleAccount*) user_data;
     GError* error   = NULL;
-    GList* items    = secret_collection_search_finish(plugin_collection, result, &error);
+    GList* items    = secret_collection_search_finish(SECRET_COLLECTION(source), result, &error);
 
-    if(error != NULL)
+    // Plugin was unloaded, user_data is gone
+    if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
     {
-        print_protocol_error_message(purple_account_get_protocol_name(account), "Could not delete password", error);
         g_error_free(error);
+        return;
     }
-    else if (items == NULL)
+
+    KeyringCollection* kc = (KeyringCollection*) user_data;
+
+    if(error != NULL)
     {
-        purple_debug_info(PLUGIN_ID, "%s: No password found for deletion", account->protocol_id);
-        /* print_protocol_info_message(purple_account_get_protocol_name(account), "Password is empty or no password given"); */
+        purple_debug_warning(PLUGIN_ID, "Could not search keyring %s for migration: %s\n", keyring_collection_name(kc), error->message);
+        g_error_free(error);
+        kc->migration_failed = TRUE;
+        if(--kc->migrating == 0) collection_migrated(kc);
+        return;
     }
-    else
-    {
-            SecretItem* item    = items->data;
-            SecretValue* value  = secret_item_get_secret(item);
-
-            purple_account_set_password(account, secret_value_get_text(value));
 
-            secret_value_unref(value);
-            secret_item_delete(item, NULL, on_password_deleted, user_data);
+    for(GList* li = items; li != NULL; li = li->next)
+    {
+        GHashTable* legacy      = secret_item_get_attributes(li->data);
+        const gchar* protocol   = g_hash_table_lookup(legacy, "protocol");
+        const gchar* username   = g_hash_table_lookup(legacy, "username");
 
-            g_object_unref(item);
-            g_list_free(items);
+        if((protocol != NULL) && (username != NULL))
+        {
+            GHashTable* attributes  = g_hash_table_new(g_str_hash, g_str_equal);
+            g_hash_table_insert(attributes, "program" , (gpointer*) SCHEMA_PROGRAM);
+            g_hash_table_insert(attributes, "protocol" , (gpointer*) protocol);
+            g_hash_table_insert(attributes, "username" , (gpointer*) username);
+
+            kc->migrating++;
+            secret_item_set_attributes(li->data, PURPLE_SCHEMA, attributes, kc->cancellable, on_item_migrated, kc);
+            g_hash_table_destroy(attributes);
+        }
 
+        g_hash_table_unref(legacy);
     }
 
+    purple_debug_info(PLUGIN_ID, "Migrating %u items in keyring %s\n", kc->migrating - 1, keyring_collection_name(kc));
+    g_list_free_full(items, g_object_unref);
+
+    if(--kc->migrating == 0) collection_migrated(kc);
 }
 
-// Delete password function
-static void delete_account_password(gpointer data, gpointer user_data)
+static void migrate_collection(gpointer data, gpointer user_data)
 {
-    PurpleAccount* account  = (PurpleAccount*) data;
-
-    purple_account_set_remember_password(account, FALSE);
-    GHashTable* attributes = get_attributes(account);
+    KeyringCollection* kc   = (KeyringCollection*) data;
+    GHashTable* attributes  = g_hash_table_new(g_str_hash, g_str_equal);
 
-    unlock_collection();
-    secret_collection_search(plugin_collection,
-            PURPLE_SCHEMA,
+    // No attributes: every item of the legacy schema
+    secret_collection_search(kc->collection,
+            LEGACY_SCHEMA,
             attributes,
-            SECRET_SEARCH_ALL | SECRET_SEARCH_LOAD_SECRETS,
-            NULL,
-            delete_collection_password,
-            data);
+            SECRET_SEARCH_ALL,
+            kc->cancellable,
+            on_legacy_items_found,
+            kc);
 
     g_hash_table_destroy(attributes);
+}
+
+// One-time background pass per keyring, locked keyrings are migrated once unlocked
+static void migrate_schema()
+{
+    // The broker migrates every keyring it indexes, once for all instances
+    if(plugin_broker != NULL) return;
+
+    for(GList* li = plugin_collections; li != NULL; li = li->next)
+    {
+        KeyringCollection* kc = li->data;
+
+        // Done, already running, or retried once the keyring shows up
+        if((kc->collection == NULL) || kc->migrated || (kc->migrating > 0)) continue;
+
+        // Held until all rewrites of the keyring are sent
+        kc->migrating           = 1;
+        kc->migration_failed    = FALSE;
+        update_collection_state(kc);
+
+        if(kc->state == COLLECTION_UNLOCKED) migrate_collection(kc, NULL);
+        else queue_operation(kc, migrate_collection, kc, NULL, NULL);
+    }
+}
+
+/**************************************************
+ **************************************************
+ ************ Password write-through **************
+ **************************************************
+ **************************************************/
+
+// libpurple has no signal for password changes. The account password is
+// compared with the keyring before every connect instead, so a changed
+// password is stored before the login and never costs a failed attempt.
 
+// Keyring holds the account password, or a store of it is in flight
+static gboolean password_in_keyring(PurpleAccount* account)
+{
+    AccountCredential* cred = get_account_credential(account);
+    gchar* digest           = password_digest(purple_account_get_password(account));
+    gboolean found          = (g_strcmp0(digest, cred->keyring_digest) == 0) || (g_strcmp0(digest, cred->pending_digest) == 0);
+
+    secret_password_free(digest);
+    return found;
+}
+
+// Store only changed passwords. Unknown accounts only with auto save enabled.
+static void write_through_password(PurpleAccount* account)
+{
+    if(purple_account_get_password(account) == NULL) return;
+    if(password_in_keyring(account)) return;
+
+    if((get_account_credential(account)->keyring_digest == NULL) && (!purple_prefs_get_bool(KEYRING_AUTO_SAVE_PREF)))
+        return;
+
+    purple_debug_info(PLUGIN_ID, "Password of %s with username %s changed, writing through\n", account->protocol_id, account->username);
+    store_account_password(account, NULL);
 }
 
 /**************************************************
@@ -543,15 +2405,23 @@ static void delete_all_passwords(PurplePluginAction* action)
  **************************************************/
 
 // Account auth-failure helper
-static void account_reset_password(PurpleAccount* account, const char* user_data)
+static void account_reset_password(AccountRef* ref, const char* password)
 {
-    if(user_data != NULL)
+    PurpleAccount* account = account_ref_get(ref);
+    account_ref_free(ref);
+
+    if((account != NULL) && (password != NULL))
     {
-        purple_account_set_password(account, user_data);
+        account_set_password(account, password);
         store_account_password(account, NULL);
     }
 }
 
+static void account_reset_password_cancel(AccountRef* ref, const char* password)
+{
+    account_ref_free(ref);
+}
+
 // Signal account added action
 static void account_added(PurpleAccount* account, gpointer data)
 {
@@ -562,7 +2432,7 @@ static void account_added(PurpleAccount* account, gpointer data)
 // Signal account removed action
 static void account_removed(PurpleAccount* account, gpointer data)
 {
-    delete_account_password(account, NULL);
+    delete_removed_account_password(account);
     purple_debug_info(PLUGIN_ID, "Deleted %s with username %s\n", account->protocol_id, account->username);
 }
 
@@ -573,26 +2443,39 @@ static void account_enabled(PurpleAccount* account, gpointer data)
     purple_debug_info(PLUGIN_ID, "Enabled %s with username %s\n", account->protocol_id, account->username);
 }
 
+// Account is freed, pending callbacks must not resolve it anymore
+static void account_destroying(PurpleAccount* account, gpointer data)
+{
+    g_hash_table_remove(plugin_credentials, account);
+}
+
 // Account disabled
 static void account_disabled(PurpleAccount* account, gpointer data)
 {
     purple_debug_info(PLUGIN_ID, "Disabled %s with username %s\n", account->protocol_id, account->username);
 }
 
+// Account connecting, runs before the password is sent. The items of an old
+// name are looked up first, a password stored right after wins over them.
+static void account_connecting(PurpleAccount* account, gpointer data)
+{
+    take_renamed_items(get_account_credential(account), FALSE);
+    write_through_password(account);
+}
+
 // Account signed on
 static void account_signed_on(PurpleAccount* account, gpointer data)
 {
-    static const char* lorem = "Lorem ipsum dolor sit amet, consectetur adipiscing elit. Cras eu semper eros. Donec non gravida mi. Vestibulum ante ipsum primis in faucibus orci luctus et ultrices posuere cubilia Curae; Phasellus malesuada nisl eget est elementum, in ullamcorper nullam.";
-    if((account->password != NULL) && (purple_account_get_remember_password(account)))
+    if((account->password != NULL) && (purple_account_get_remember_password(account)) && (!password_in_keyring(account)))
     {
         store_account_password(account, data);
         purple_debug_info(PLUGIN_ID, "Signed on. Saving password for %s with username %s\n", account->protocol_id, account->username);
     }
     else if(account->password != NULL)
     {
-        purple_account_set_password(account, lorem);
-        g_free(account->password);
-        account->password = NULL;
+        // Either not remembered or already in the keyring
+        account_clear_password(account);
+        purple_account_set_remember_password(account, FALSE);
         purple_debug_info(PLUGIN_ID, "Signed on. Cleared password for %s with username %s\n", account->protocol_id, account->username);
     }
 
@@ -606,7 +2489,8 @@ static void account_connection_error(PurpleAccount* account, PurpleConnectionErr
     if( err == PURPLE_CONNECTION_ERROR_AUTHENTICATION_FAILED )
     {
         purple_debug_info(PLUGIN_ID, "Debug info. Auth error\n");
-        purple_request_input (gnome_keyring_plugin,
+        AccountRef* ref = account_ref_new(get_account_credential(account));
+        void* request   = purple_request_input (gnome_keyring_plugin,
                 "Gnome Keyring",
                 "Could not connect to the server due to authetication failure.",
                 "Please insert the correct password. The password will be saved the choosen keyring.",
@@ -617,13 +2501,16 @@ static void account_connection_error(PurpleAccount* account, PurpleConnectionErr
                 "Save in keyring",
                 G_CALLBACK(account_reset_password),
                 "Cancel",
-                NULL,
+                G_CALLBACK(account_reset_password_cancel),
                 account,
                 NULL,
                 NULL,
-                account
+                ref
                 );
 
+        // No request UI, e.g. a headless client: neither callback runs
+        if(request == NULL) account_ref_free(ref);
+
     }
     else if( err == PURPLE_CONNECTION_ERROR_NETWORK_ERROR)
     {
@@ -654,15 +2541,15 @@ static GList* plugin_actions(PurplePlugin* plugin, gpointer context)
 
     const gchar* name = (purple_prefs_get_bool(KEYRING_CUSTOM_NAME_PREF) ? purple_prefs_get_string(KEYRING_NAME_PREF) : "(default)");
 
-    gchar msg[255] = "Save all passwords to keyring: ";
-    strcat(msg, name);
+    gchar* msg = g_strdup_printf("Save all passwords to keyring: %s", name);
     action  = purple_plugin_action_new(msg, save_all_passwords);
     list    = g_list_append(list, action);
+    g_free(msg);
 
-    strncpy(msg, "Delete all passwords from keyring: ", sizeof(msg));
-    strcat(msg, name);
+    msg     = g_strdup_printf("Delete all passwords from keyring: %s", name);
     action  = purple_plugin_action_new(msg, delete_all_passwords);
     list    = g_list_append(list, action);
+    g_free(msg);
 
     return list;
 }
@@ -692,23 +2579,36 @@ static PurplePluginPrefFrame* get_plugin_pref_frame(PurplePlugin* plugin)
     ppref = purple_plugin_pref_new_with_name_and_label( KEYRING_NAME_PREF,"Gnome Keyring name: " );
     purple_plugin_pref_frame_add(frame, ppref);
 
+    ppref = purple_plugin_pref_new_with_name_and_label( KEYRING_ROUTES_PREF, "Keyring routes, applied on plugin load.\nFormat: protocol[/username]=keyring;... e.g. prpl-irc/*bot*=Bots" );
+    purple_plugin_pref_frame_add(frame, ppref);
+
     ppref = purple_plugin_pref_new_with_name_and_label( KEYRING_AUTO_SAVE_PREF, "Save new passwords to Gnome Keyring" );
     purple_plugin_pref_frame_add(frame, ppref);
 
     ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_AUTO_LOCK_PREF, "Lock keyring when closing messanger passwords?");
     purple_plugin_pref_frame_add(frame, ppref);
 
+    ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_CALL_TIMEOUT_PREF, "Keyring call deadline in ms, unlock prompts have none.\nSlower calls switch to degraded mode and load passwords in the background");
+    purple_plugin_pref_set_bounds(ppref, 100, 600000);
+    purple_plugin_pref_frame_add(frame, ppref);
+
+    ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_BROKER_PREF, "Load passwords through the credential broker, applied on plugin load.\nShares one keyring session between messenger instances, if the broker runs");
+    purple_plugin_pref_frame_add(frame, ppref);
+
+    ppref = purple_plugin_pref_new_with_name_and_label(KEYRING_PROFILE_PREF, "Print a startup profile to the debug log");
+    purple_plugin_pref_frame_add(frame, ppref);
+
     return frame;
 
 }
 
-/* static void enable_account(gpointer data, gpointer user_data) */
-/* { */
-/*     PurpleAccount* account = (PurpleAccount*) data; */
-/*     purple_request_close_with_handle(account); */
-/*     load_account_password(account, NULL); */
-/*     purple_account_set_enabled(account, purple_core_get_ui(), TRUE); */
-/* } */
+// Password is loaded by the account-enabled signal
+static void enable_account(gpointer data, gpointer user_data)
+{
+    PurpleAccount* account = (PurpleAccount*) data;
+    purple_request_close_with_handle(account);
+    purple_account_set_enabled(account, purple_core_get_ui(), TRUE);
+}
 
 static void disable_account(gpointer data, gpointer user_data)
 {
@@ -717,10 +2617,48 @@ static void disable_account(gpointer data, gpointer user_data)
     purple_request_close_with_handle(account);
 }
 
+// Accounts of a locked keyring stay disabled until that keyring is unlocked
+static void startup_load_account(gpointer data, gpointer user_data)
+{
+    PurpleAccount* account  = (PurpleAccount*) data;
+    ProfileMark mark        = profile_begin();
+    AccountCredential* cred = get_account_credential(account);
+
+    if(plugin_health == KEYRING_DEGRADED)
+    {
+        // Keyring did not answer the connect, the load is deferred
+        load_account_password(account, NULL);
+        profile_end(&mark, g_strdup_printf("defer_account_load %s/%s", cred->protocol_id, cred->username));
+    }
+    else if(collection_ready(cred, enable_account))
+    {
+        load_account_password(account, NULL);
+        profile_end(&mark, g_strdup_printf("load_account_password %s/%s", cred->protocol_id, cred->username));
+    }
+    else if((cred->collection != NULL) && (cred->collection->collection != NULL))
+    {
+        disable_account(account, NULL);
+        profile_end(&mark, g_strdup_printf("disable_account %s/%s", cred->protocol_id, cred->username));
+    }
+}
+
 // Load plugin
 static gboolean plugin_load(PurplePlugin* plugin)
 {
     gnome_keyring_plugin = plugin;
+
+    if(!init_digest_key())
+    {
+        dialog( PURPLE_NOTIFY_MSG_ERROR, "Could not load the Gnome Keyring plugin.", "No random source available, neither getrandom nor /dev/urandom.");
+        return FALSE;
+    }
+
+    watchdog_start();
+    profile_start();
+    dbus_counter_start();
+
+    ProfileMark total   = profile_begin();
+    ProfileMark mark    = profile_begin();
     GList *accounts = NULL;
     accounts = purple_accounts_get_all_active();
 
@@ -734,18 +2672,28 @@ static gboolean plugin_load(PurplePlugin* plugin)
     /* Accounts subsystem signals */
     purple_signal_connect(accounts_handle, "account-enabled",       plugin, PURPLE_CALLBACK(account_enabled),       NULL);
     purple_signal_connect(accounts_handle, "account-disabled",       plugin, PURPLE_CALLBACK(account_disabled),       NULL);
+    purple_signal_connect(accounts_handle, "account-connecting",    plugin, PURPLE_CALLBACK(account_connecting),    NULL);
     purple_signal_connect(accounts_handle, "account-signed-on",     plugin, PURPLE_CALLBACK(account_signed_on),     NULL);
     purple_signal_connect(accounts_handle, "account-connection-error",  plugin, PURPLE_CALLBACK(account_connection_error), NULL);
+    purple_signal_connect(accounts_handle, "account-destroying",    plugin, PURPLE_CALLBACK(account_destroying),    NULL);
 
     if(purple_prefs_get_bool(KEYRING_AUTO_SAVE_PREF))
     {
         purple_signal_connect(accounts_handle, "account-added",     plugin, PURPLE_CALLBACK(account_added),     NULL);
         purple_signal_connect(accounts_handle, "account-removed",   plugin, PURPLE_CALLBACK(account_removed),   NULL);
     }
+    profile_end(&mark, g_strdup("signals"));
+
+    // Migration and probes are left to the broker if it is running
+    mark = profile_begin();
+    broker_connect();
+    profile_end(&mark, g_strdup("broker_connect"));
 
     // Load collection when plugin is activated
+    mark = profile_begin();
     init_collection();
-    gboolean was_locked = unlock_collection();
+    plugin_credentials = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) account_credential_free);
+    profile_end(&mark, g_strdup("init_collection"));
 
     if(purple_prefs_get_int(KEYRING_PLUG_STATUS_PREF) == UNLOADED)
     {
@@ -767,10 +2715,17 @@ static gboolean plugin_load(PurplePlugin* plugin)
     }
     else
     {
-        if(was_locked) g_list_foreach(accounts, disable_account, NULL);
-        g_list_foreach(accounts, load_account_password, NULL);
-        /* g_list_foreach(accounts, enable_account, NULL); */
+        mark = profile_begin();
+        g_list_foreach(accounts, startup_load_account, NULL);
+        profile_end(&mark, g_strdup_printf("accounts (%u)", g_list_length(accounts)));
     }
+    g_list_free(accounts);
+
+    mark = profile_begin();
+    migrate_schema();
+    profile_end(&mark, g_strdup("migrate_schema"));
+    profile_end(&total, g_strdup("plugin_load"));
+    profile_report();
 
     /* if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection(); */
     purple_prefs_set_int(KEYRING_PLUG_STATUS_PREF, LOADED);
@@ -789,10 +2744,21 @@ static gboolean plugin_unload(PurplePlugin* plugin)
     purple_signals_disconnect_by_handle(plugin);
     purple_prefs_disconnect_by_handle(plugin);
 
-    if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF)) lock_collection();
-    g_object_unref(plugin_collection);
-    g_object_unref(plugin_service);
+    if(purple_prefs_get_bool(KEYRING_AUTO_LOCK_PREF))
+    {
+        for(GList* li = plugin_collections; li != NULL; li = li->next) lock_collection(li->data);
+    }
+    report_keyring_stats();
+    broker_disconnect();
+    watchdog_stop();
+    g_hash_table_destroy(plugin_credentials);
+    plugin_credentials = NULL;
+    memset(plugin_digest_key, 0, sizeof(plugin_digest_key));
+    free_collections();
+    if(plugin_service != NULL) g_object_unref(plugin_service);
+    plugin_service = NULL;
     secret_service_disconnect();
+    dbus_counter_stop();
 
     if(purple_prefs_get_int(KEYRING_PLUG_STATUS_PREF) == LOADED) purple_prefs_set_int(KEYRING_PLUG_STATUS_PREF, UNLOADED);
     printf("unloaded\n");
@@ -849,14 +2815,21 @@ static void init_plugin(PurplePlugin *plugin)
     purple_prefs_add_none("/plugins/core/purple_gnome_keyring");
     purple_prefs_add_bool(KEYRING_CUSTOM_NAME_PREF, KEYRING_CUSTOM_NAME_DEFAULT);
     purple_prefs_add_string(KEYRING_NAME_PREF, KEYRING_NAME_DEFAULT);
+    purple_prefs_add_string(KEYRING_ROUTES_PREF, KEYRING_ROUTES_DEFAULT);
 
     purple_prefs_add_bool(KEYRING_AUTO_SAVE_PREF, KEYRING_AUTO_SAVE_DEFAULT);
     purple_prefs_add_bool(KEYRING_AUTO_LOCK_PREF, KEYRING_AUTO_LOCK_DEFAULT);
 
     purple_prefs_add_int(KEYRING_PLUG_STATUS_PREF, KEYRING_PLUG_STATUS_DEFAULT);
+    purple_prefs_add_string_list(KEYRING_MIGRATED_PREF, NULL);
+    purple_prefs_add_int(KEYRING_CALL_TIMEOUT_PREF, KEYRING_CALL_TIMEOUT_DEFAULT);
+    purple_prefs_add_bool(KEYRING_PROFILE_PREF, KEYRING_PROFILE_DEFAULT);
+    purple_prefs_add_bool(KEYRING_BROKER_PREF, KEYRING_BROKER_DEFAULT);
 
     purple_prefs_remove("/plugins/core/purple_gnome_keyring/keyring_name");
     purple_prefs_remove("/plugins/core/purple_gnome_keyring/plug_state");
+    purple_prefs_remove("/plugins/core/purple_gnome_keyring/prompt_timeout");
+    purple_prefs_remove("/plugins/core/purple_gnome_keyring/schema_version");
 
 }
 
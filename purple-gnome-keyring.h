@@ -0,0 +1,84 @@
+#ifndef PURPLE_GNOME_KEYRING_H
+#define PURPLE_GNOME_KEYRING_H
+
+// Definitions shared by the plugin and the credential broker
+
+#include <glib.h>
+#include <string.h>
+
+// Needed for secret_service_get_secret_for_dbus_path_sync
+#define SECRET_API_SUBJECT_TO_CHANGE
+#include <libsecret/secret.h>
+
+#define PLUGIN_ID "core-grburst-purple_gnome_keyring"
+
+// Keyring items
+#define PURPLE_SCHEMA   get_purple_schema()
+#define LEGACY_SCHEMA   get_legacy_schema()
+#define SCHEMA_VERSION  2
+#define SCHEMA_PROGRAM  PLUGIN_ID
+
+// Credential broker
+#define BROKER_BUS_NAME     "im.pidgin.purple.GnomeKeyringBroker"
+#define BROKER_OBJECT_PATH  "/im/pidgin/purple/GnomeKeyringBroker"
+#define BROKER_INTERFACE    "im.pidgin.purple.GnomeKeyringBroker"
+
+// Result of a broker Lookup
+typedef enum {BROKER_FOUND = 0, BROKER_NOT_FOUND = 1, BROKER_UNAVAILABLE = 2} broker_status;
+
+// Version 2: items carry the program attribute, so searches only match our own items
+static inline const SecretSchema* get_purple_schema(void)
+{
+    static const SecretSchema schema = {
+        "purple gnome keyring password scheme v2", SECRET_SCHEMA_NONE,
+        {
+            {  "program", SECRET_SCHEMA_ATTRIBUTE_STRING },
+            {  "protocol", SECRET_SCHEMA_ATTRIBUTE_STRING },
+            {  "username", SECRET_SCHEMA_ATTRIBUTE_STRING },
+            {  "NULL", 0 },
+        }
+    };
+    return &schema;
+}
+
+// Version 1, only used to find items which still need a migration
+static inline const SecretSchema* get_legacy_schema(void)
+{
+    static const SecretSchema schema = {
+        "pidgin password scheme", SECRET_SCHEMA_NONE,
+        {
+            {  "protocol", SECRET_SCHEMA_ATTRIBUTE_STRING },
+            {  "username", SECRET_SCHEMA_ATTRIBUTE_STRING },
+            {  "NULL", 0 },
+        }
+    };
+    return &schema;
+}
+
+// Duplicates resolve to the most recently modified item. Times are whole
+// seconds, so ties go to the later created item and then to the later object
+// path, which every instance and the broker order the same way.
+static inline gboolean item_is_newer(SecretItem* item, SecretItem* than)
+{
+    if(secret_item_get_modified(item) != secret_item_get_modified(than))
+        return secret_item_get_modified(item) > secret_item_get_modified(than);
+
+    if(secret_item_get_created(item) != secret_item_get_created(than))
+        return secret_item_get_created(item) > secret_item_get_created(than);
+
+    // Item paths end in a counter, a longer path is a later item
+    const gchar* a  = g_dbus_proxy_get_object_path(G_DBUS_PROXY(item));
+    const gchar* b  = g_dbus_proxy_get_object_path(G_DBUS_PROXY(than));
+    gsize la        = strlen(a);
+    gsize lb        = strlen(b);
+
+    return (la != lb) ? (la > lb) : (strcmp(a, b) > 0);
+}
+
+// Private socket of the broker, only reachable by the same user
+static inline gchar* broker_socket_path(void)
+{
+    return g_build_filename(g_get_user_runtime_dir(), "purple-gnome-keyring", "broker", NULL);
+}
+
+#endif
@@ -0,0 +1,980 @@
+// Mock keyring for the stress target
+//
+// Serves org.freedesktop.secrets from memory, so the plugin can be stressed
+// without touching a real keyring. One collection "login", aliased as
+// default, and plain sessions only. Run it on a private bus, see the stress
+// rule of the Makefile.
+//
+// Usage: mock-secret-service [--locked] [--delay MS]
+// --locked starts with a locked collection, every Unlock succeeds without a
+// prompt. --delay answers every method call late, e.g. to hit the call
+// deadlines of the plugin.
+
+#define G_LOG_DOMAIN "mock-secret-service"
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+#include <string.h>
+
+#define SECRETS_BUS_NAME        "org.freedesktop.secrets"
+#define SERVICE_PATH            "/org/freedesktop/secrets"
+#define COLLECTION_PATH         "/org/freedesktop/secrets/collection/login"
+#define SESSION_PATH            "/org/freedesktop/secrets/session"
+
+#define SERVICE_INTERFACE       "org.freedesktop.Secret.Service"
+#define COLLECTION_INTERFACE    "org.freedesktop.Secret.Collection"
+#define ITEM_INTERFACE          "org.freedesktop.Secret.Item"
+#define SESSION_INTERFACE       "org.freedesktop.Secret.Session"
+
+#define IS_LOCKED_ERROR         "org.freedesktop.Secret.Error.IsLocked"
+#define NO_SESSION_ERROR        "org.freedesktop.Secret.Error.NoSession"
+#define NO_SUCH_OBJECT_ERROR    "org.freedesktop.Secret.Error.NoSuchObject"
+#define NOT_SUPPORTED_ERROR     "org.freedesktop.DBus.Error.NotSupported"
+
+#define NO_PROMPT               "/"
+
+static const gchar mock_introspection_xml[] =
+    "<node>"
+    "  <interface name='" SERVICE_INTERFACE "'>"
+    "    <method name='OpenSession'>"
+    "      <arg type='s' name='algorithm' direction='in'/>"
+    "      <arg type='v' name='input' direction='in'/>"
+    "      <arg type='v' name='output' direction='out'/>"
+    "      <arg type='o' name='result' direction='out'/>"
+    "    </method>"
+    "    <method name='CreateCollection'>"
+    "      <arg type='a{sv}' name='properties' direction='in'/>"
+    "      <arg type='s' name='alias' direction='in'/>"
+    "      <arg type='o' name='collection' direction='out'/>"
+    "      <arg type='o' name='prompt' direction='out'/>"
+    "    </method>"
+    "    <method name='SearchItems'>"
+    "      <arg type='a{ss}' name='attributes' direction='in'/>"
+    "      <arg type='ao' name='unlocked' direction='out'/>"
+    "      <arg type='ao' name='locked' direction='out'/>"
+    "    </method>"
+    "    <method name='Unlock'>"
+    "      <arg type='ao' name='objects' direction='in'/>"
+    "      <arg type='ao' name='unlocked' direction='out'/>"
+    "      <arg type='o' name='prompt' direction='out'/>"
+    "    </method>"
+    "    <method name='Lock'>"
+    "      <arg type='ao' name='objects' direction='in'/>"
+    "      <arg type='ao' name='locked' direction='out'/>"
+    "      <arg type='o' name='prompt' direction='out'/>"
+    "    </method>"
+    "    <method name='GetSecrets'>"
+    "      <arg type='ao' name='items' direction='in'/>"
+    "      <arg type='o' name='session' direction='in'/>"
+    "      <arg type='a{o(oayays)}' name='secrets' direction='out'/>"
+    "    </method>"
+    "    <method name='ReadAlias'>"
+    "      <arg type='s' name='name' direction='in'/>"
+    "      <arg type='o' name='collection' direction='out'/>"
+    "    </method>"
+    "    <method name='SetAlias'>"
+    "      <arg type='s' name='name' direction='in'/>"
+    "      <arg type='o' name='collection' direction='in'/>"
+    "    </method>"
+    "    <property name='Collections' type='ao' access='read'/>"
+    "  </interface>"
+    "  <interface name='" COLLECTION_INTERFACE "'>"
+    "    <method name='Delete'>"
+    "      <arg type='o' name='prompt' direction='out'/>"
+    "    </method>"
+    "    <method name='SearchItems'>"
+    "      <arg type='a{ss}' name='attributes' direction='in'/>"
+    "      <arg type='ao' name='results' direction='out'/>"
+    "    </method>"
+    "    <method name='CreateItem'>"
+    "      <arg type='a{sv}' name='properties' direction='in'/>"
+    "      <arg type='(oayays)' name='secret' direction='in'/>"
+    "      <arg type='b' name='replace' direction='in'/>"
+    "      <arg type='o' name='item' direction='out'/>"
+    "      <arg type='o' name='prompt' direction='out'/>"
+    "    </method>"
+    "    <signal name='ItemCreated'><arg type='o' name='item'/></signal>"
+    "    <signal name='ItemDeleted'><arg type='o' name='item'/></signal>"
+    "    <signal name='ItemChanged'><arg type='o' name='item'/></signal>"
+    "    <property name='Items' type='ao' access='read'/>"
+    "    <property name='Label' type='s' access='readwrite'/>"
+    "    <property name='Locked' type='b' access='read'/>"
+    "    <property name='Created' type='t' access='read'/>"
+    "    <property name='Modified' type='t' access='read'/>"
+    "  </interface>"
+    "  <interface name='" ITEM_INTERFACE "'>"
+    "    <method name='Delete'>"
+    "      <arg type='o' name='prompt' direction='out'/>"
+    "    </method>"
+    "    <method name='GetSecret'>"
+    "      <arg type='o' name='session' direction='in'/>"
+    "      <arg type='(oayays)' name='secret' direction='out'/>"
+    "    </method>"
+    "    <method name='SetSecret'>"
+    "      <arg type='(oayays)' name='secret' direction='in'/>"
+    "    </method>"
+    "    <property name='Locked' type='b' access='read'/>"
+    "    <property name='Attributes' type='a{ss}' access='readwrite'/>"
+    "    <property name='Label' type='s' access='readwrite'/>"
+    "    <property name='Created' type='t' access='read'/>"
+    "    <property name='Modified' type='t' access='read'/>"
+    "  </interface>"
+    "  <interface name='" SESSION_INTERFACE "'>"
+    "    <method name='Close'/>"
+    "  </interface>"
+    "</node>";
+
+// Keyring item, registered as its own object
+typedef struct {
+    gchar* path;
+    gchar* label;
+    GHashTable* attributes;         // gchar* -> gchar*
+    GBytes* secret;
+    gchar* content_type;
+    guint64 created;
+    guint64 modified;
+    guint registration;
+} MockItem;
+
+// Reply, sent late with --delay
+typedef struct {
+    GDBusMethodInvocation* invocation;
+    GVariant* value;                // Floating, NULL for errors and empty replies
+    gchar* error_name;
+    gchar* error_message;
+} MockReply;
+
+GDBusConnection* mock_connection        = NULL;
+GDBusNodeInfo* mock_introspection       = NULL;
+GMainLoop* mock_loop                    = NULL;
+GHashTable* mock_items                  = NULL;     // Object path -> MockItem, owns the items
+GHashTable* mock_sessions               = NULL;     // Object path -> registration id
+GHashTable* mock_calls                  = NULL;     // "Interface.Method" -> count
+gboolean mock_locked                    = FALSE;
+gint mock_delay                         = 0;
+guint64 mock_created                    = 0;
+guint mock_next_item                    = 0;
+guint mock_next_session                 = 0;
+
+static const GDBusInterfaceVTable item_vtable;
+static const GDBusInterfaceVTable session_vtable;
+
+/**************************************************
+ **************************************************
+ ******************* Helpers **********************
+ **************************************************
+ **************************************************/
+
+static guint64 now()
+{
+    return g_get_real_time() / G_USEC_PER_SEC;
+}
+
+static GDBusInterfaceInfo* interface_info(const gchar* name)
+{
+    return g_dbus_node_info_lookup_interface(mock_introspection, name);
+}
+
+static void count_call(const gchar* interface_name, const gchar* method_name)
+{
+    gchar* key      = g_strdup_printf("%s.%s", interface_name, method_name);
+    guint count     = GPOINTER_TO_UINT(g_hash_table_lookup(mock_calls, key));
+
+    g_hash_table_replace(mock_calls, key, GUINT_TO_POINTER(count + 1));
+}
+
+static gboolean send_reply(gpointer data)
+{
+    MockReply* reply = (MockReply*) data;
+
+    if(reply->error_name != NULL)
+        g_dbus_method_invocation_return_dbus_error(reply->invocation, reply->error_name, reply->error_message);
+    else
+        g_dbus_method_invocation_return_value(reply->invocation, reply->value);
+
+    g_free(reply->error_name);
+    g_free(reply->error_message);
+    g_free(reply);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void queue_reply(MockReply* reply)
+{
+    if(mock_delay > 0) g_timeout_add(mock_delay, send_reply, reply);
+    else send_reply(reply);
+}
+
+static void mock_return(GDBusMethodInvocation* invocation, GVariant* value)
+{
+    MockReply* reply    = g_new0(MockReply, 1);
+    reply->invocation   = invocation;
+    reply->value        = value;
+
+    queue_reply(reply);
+}
+
+static void mock_return_error(GDBusMethodInvocation* invocation, const gchar* name, const gchar* message)
+{
+    MockReply* reply    = g_new0(MockReply, 1);
+    reply->invocation   = invocation;
+    reply->error_name   = g_strdup(name);
+    reply->error_message= g_strdup(message);
+
+    queue_reply(reply);
+}
+
+static GHashTable* attributes_new(GVariant* attributes)
+{
+    GHashTable* table   = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    GVariantIter iter;
+    const gchar* key;
+    const gchar* value;
+
+    if(attributes == NULL) return table;
+
+    g_variant_iter_init(&iter, attributes);
+    while(g_variant_iter_next(&iter, "{&s&s}", &key, &value))
+        g_hash_table_replace(table, g_strdup(key), g_strdup(value));
+
+    return table;
+}
+
+static GVariant* attributes_variant(GHashTable* attributes)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{ss}"));
+    g_hash_table_iter_init(&iter, attributes);
+    while(g_hash_table_iter_next(&iter, &key, &value))
+        g_variant_builder_add(&builder, "{ss}", key, value);
+
+    return g_variant_builder_end(&builder);
+}
+
+// Every queried attribute is set on the item with the same value
+static gboolean attributes_match(GHashTable* attributes, GHashTable* query)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, query);
+    while(g_hash_table_iter_next(&iter, &key, &value))
+    {
+        if(g_strcmp0(g_hash_table_lookup(attributes, key), value) != 0) return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean attributes_equal(GHashTable* a, GHashTable* b)
+{
+    return (g_hash_table_size(a) == g_hash_table_size(b)) && attributes_match(a, b);
+}
+
+static gboolean session_valid(const gchar* session)
+{
+    return g_hash_table_contains(mock_sessions, session);
+}
+
+static void emit_properties_changed(const gchar* path, const gchar* interface_name, const gchar* property, GVariant* value)
+{
+    GVariantBuilder changed;
+    g_variant_builder_init(&changed, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&changed, "{sv}", property, value);
+
+    g_dbus_connection_emit_signal(mock_connection,
+            NULL,
+            path,
+            "org.freedesktop.DBus.Properties",
+            "PropertiesChanged",
+            g_variant_new("(sa{sv}@as)", interface_name, &changed, g_variant_new_strv(NULL, 0)),
+            NULL);
+}
+
+static void emit_item_signal(const gchar* signal, const gchar* path)
+{
+    g_dbus_connection_emit_signal(mock_connection, NULL, COLLECTION_PATH, COLLECTION_INTERFACE, signal, g_variant_new("(o)", path), NULL);
+}
+
+/**************************************************
+ **************************************************
+ ******************** Items ***********************
+ **************************************************
+ **************************************************/
+
+static void mock_item_free(gpointer data)
+{
+    MockItem* item = (MockItem*) data;
+
+    g_free(item->path);
+    g_free(item->label);
+    g_hash_table_destroy(item->attributes);
+    g_bytes_unref(item->secret);
+    g_free(item->content_type);
+    g_free(item);
+}
+
+// Secret of item in the plain session format, no parameters
+static GVariant* item_secret(MockItem* item, const gchar* session)
+{
+    gsize length        = 0;
+    gconstpointer data  = g_bytes_get_data(item->secret, &length);
+
+    return g_variant_new("(o@ay@ays)",
+            session,
+            g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, "", 0, 1),
+            g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, (data != NULL) ? data : "", length, 1),
+            item->content_type);
+}
+
+// Takes the secret of the (oayays) struct, NULL for unknown sessions
+static GBytes* parse_secret(GVariant* secret, gchar** content_type)
+{
+    const gchar* session;
+    const gchar* type;
+    GVariant* parameters;
+    GVariant* value;
+    gsize length;
+
+    g_variant_get(secret, "(&o@ay@ay&s)", &session, &parameters, &value, &type);
+
+    GBytes* bytes = NULL;
+    if(session_valid(session))
+    {
+        gconstpointer data  = g_variant_get_fixed_array(value, &length, 1);
+        bytes               = g_bytes_new(data, length);
+        *content_type       = g_strdup(type);
+    }
+
+    g_variant_unref(parameters);
+    g_variant_unref(value);
+
+    return bytes;
+}
+
+static void search_items(GHashTable* query, GVariantBuilder* results)
+{
+    GHashTableIter iter;
+    gpointer path, item;
+
+    g_hash_table_iter_init(&iter, mock_items);
+    while(g_hash_table_iter_next(&iter, &path, &item))
+    {
+        if(attributes_match(((MockItem*) item)->attributes, query)) g_variant_builder_add(results, "o", path);
+    }
+}
+
+static MockItem* find_item(GHashTable* attributes)
+{
+    GHashTableIter iter;
+    gpointer path, item;
+
+    g_hash_table_iter_init(&iter, mock_items);
+    while(g_hash_table_iter_next(&iter, &path, &item))
+    {
+        if(attributes_equal(((MockItem*) item)->attributes, attributes)) return item;
+    }
+
+    return NULL;
+}
+
+static MockItem* create_item(const gchar* label, GHashTable* attributes, GBytes* secret, gchar* content_type)
+{
+    GError* error       = NULL;
+    MockItem* item      = g_new0(MockItem, 1);
+    item->path          = g_strdup_printf("%s/%u", COLLECTION_PATH, ++mock_next_item);
+    item->label         = g_strdup(label);
+    item->attributes    = attributes;
+    item->secret        = secret;
+    item->content_type  = content_type;
+    item->created       = now();
+    item->modified      = item->created;
+    item->registration  = g_dbus_connection_register_object(mock_connection, item->path, interface_info(ITEM_INTERFACE), &item_vtable, item, NULL, &error);
+
+    if(error != NULL)
+    {
+        g_warning("Could not register item %s: %s", item->path, error->message);
+        g_error_free(error);
+    }
+
+    g_hash_table_replace(mock_items, item->path, item);
+    emit_item_signal("ItemCreated", item->path);
+
+    return item;
+}
+
+static void delete_item(MockItem* item)
+{
+    g_dbus_connection_unregister_object(mock_connection, item->registration);
+    emit_item_signal("ItemDeleted", item->path);
+    g_hash_table_remove(mock_items, item->path);
+}
+
+/**************************************************
+ **************************************************
+ ****************** Locking ***********************
+ **************************************************
+ **************************************************/
+
+// The collection and all of its items lock together
+static void set_locked(gboolean locked)
+{
+    GHashTableIter iter;
+    gpointer path;
+
+    if(mock_locked == locked) return;
+    mock_locked = locked;
+
+    emit_properties_changed(COLLECTION_PATH, COLLECTION_INTERFACE, "Locked", g_variant_new_boolean(locked));
+
+    g_hash_table_iter_init(&iter, mock_items);
+    while(g_hash_table_iter_next(&iter, &path, NULL))
+        emit_properties_changed(path, ITEM_INTERFACE, "Locked", g_variant_new_boolean(locked));
+}
+
+// Objects of this collection, either unlocked or locked by the call
+static void handle_xlock(GVariant* parameters, GDBusMethodInvocation* invocation, gboolean lock)
+{
+    GVariantIter* objects;
+    const gchar* path;
+    GVariantBuilder changed;
+
+    g_variant_builder_init(&changed, G_VARIANT_TYPE("ao"));
+    g_variant_get(parameters, "(ao)", &objects);
+
+    while(g_variant_iter_next(objects, "&o", &path))
+    {
+        if((g_strcmp0(path, COLLECTION_PATH) == 0) || g_hash_table_contains(mock_items, path))
+            g_variant_builder_add(&changed, "o", path);
+    }
+
+    g_variant_iter_free(objects);
+    set_locked(lock);
+
+    mock_return(invocation, g_variant_new("(aoo)", &changed, NO_PROMPT));
+}
+
+/**************************************************
+ **************************************************
+ ******************* Service **********************
+ **************************************************
+ **************************************************/
+
+static void handle_open_session(GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+    const gchar* algorithm;
+    GVariant* input;
+    GError* error = NULL;
+
+    g_variant_get(parameters, "(&s@v)", &algorithm, &input);
+    g_variant_unref(input);
+
+    // libsecret falls back to plain on NotSupported
+    if(g_strcmp0(algorithm, "plain") != 0)
+    {
+        mock_return_error(invocation, NOT_SUPPORTED_ERROR, "Only plain sessions are supported");
+        return;
+    }
+
+    gchar* path         = g_strdup_printf("%s/%u", SESSION_PATH, ++mock_next_session);
+    guint registration  = g_dbus_connection_register_object(mock_connection, path, interface_info(SESSION_INTERFACE), &session_vtable, NULL, NULL, &error);
+
+    if(error != NULL)
+    {
+        mock_return_error(invocation, NOT_SUPPORTED_ERROR, error->message);
+        g_error_free(error);
+        g_free(path);
+        return;
+    }
+
+    g_hash_table_replace(mock_sessions, path, GUINT_TO_POINTER(registration));
+    mock_return(invocation, g_variant_new("(vo)", g_variant_new_string(""), path));
+}
+
+static void handle_service_search(GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+    GVariant* attributes;
+    GVariantBuilder unlocked, locked;
+
+    g_variant_get(parameters, "(@a{ss})", &attributes);
+    GHashTable* query = attributes_new(attributes);
+    g_variant_unref(attributes);
+
+    g_variant_builder_init(&unlocked, G_VARIANT_TYPE("ao"));
+    g_variant_builder_init(&locked, G_VARIANT_TYPE("ao"));
+    search_items(query, mock_locked ? &locked : &unlocked);
+    g_hash_table_destroy(query);
+
+    mock_return(invocation, g_variant_new("(aoao)", &unlocked, &locked));
+}
+
+// Locked and unknown items are left out
+static void handle_get_secrets(GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+    GVariantIter* paths;
+    const gchar* session;
+    const gchar* path;
+    GVariantBuilder secrets;
+
+    g_variant_get(parameters, "(ao&o)", &paths, &session);
+
+    if(!session_valid(session))
+    {
+        g_variant_iter_free(paths);
+        mock_return_error(invocation, NO_SESSION_ERROR, "No such session");
+        return;
+    }
+
+    g_variant_builder_init(&secrets, G_VARIANT_TYPE("a{o(oayays)}"));
+    while(g_variant_iter_next(paths, "&o", &path))
+    {
+        MockItem* item = g_hash_table_lookup(mock_items, path);
+        if((item != NULL) && (!mock_locked)) g_variant_builder_add(&secrets, "{o@(oayays)}", path, item_secret(item, session));
+    }
+
+    g_variant_iter_free(paths);
+    mock_return(invocation, g_variant_new("(a{o(oayays)})", &secrets));
+}
+
+static void handle_read_alias(GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+    const gchar* name;
+    g_variant_get(parameters, "(&s)", &name);
+
+    mock_return(invocation, g_variant_new("(o)", (g_strcmp0(name, "default") == 0) ? COLLECTION_PATH : "/"));
+}
+
+static void on_service_method_call(GDBusConnection* connection,
+                    const gchar* sender,
+                    const gchar* object_path,
+                    const gchar* interface_name,
+                    const gchar* method_name,
+                    GVariant* parameters,
+                    GDBusMethodInvocation* invocation,
+                    gpointer user_data)
+{
+    count_call(interface_name, method_name);
+
+    if(g_strcmp0(method_name, "OpenSession") == 0)          handle_open_session(parameters, invocation);
+    else if(g_strcmp0(method_name, "SearchItems") == 0)     handle_service_search(parameters, invocation);
+    else if(g_strcmp0(method_name, "Unlock") == 0)          handle_xlock(parameters, invocation, FALSE);
+    else if(g_strcmp0(method_name, "Lock") == 0)            handle_xlock(parameters, invocation, TRUE);
+    else if(g_strcmp0(method_name, "GetSecrets") == 0)      handle_get_secrets(parameters, invocation);
+    else if(g_strcmp0(method_name, "ReadAlias") == 0)       handle_read_alias(parameters, invocation);
+    else if(g_strcmp0(method_name, "SetAlias") == 0)        mock_return(invocation, NULL);
+    else mock_return_error(invocation, NOT_SUPPORTED_ERROR, "Not supported by the mock keyring");
+}
+
+static GVariant* on_service_get_property(GDBusConnection* connection,
+                    const gchar* sender,
+                    const gchar* object_path,
+                    const gchar* interface_name,
+                    const gchar* property_name,
+                    GError** error,
+                    gpointer user_data)
+{
+    const gchar* collections[] = {COLLECTION_PATH, NULL};
+
+    if(g_strcmp0(property_name, "Collections") == 0) return g_variant_new_objv(collections, -1);
+    return NULL;
+}
+
+static const GDBusInterfaceVTable service_vtable = {on_service_method_call, on_service_get_property, NULL, {NULL}};
+
+/**************************************************
+ **************************************************
+ ****************** Collection ********************
+ **************************************************
+ **************************************************/
+
+static void handle_collection_search(GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+    GVariant* attributes;
+    GVariantBuilder results;
+
+    g_variant_get(parameters, "(@a{ss})", &attributes);
+    GHashTable* query = attributes_new(attributes);
+    g_variant_unref(attributes);
+
+    g_variant_builder_init(&results, G_VARIANT_TYPE("ao"));
+    search_items(query, &results);
+    g_hash_table_destroy(query);
+
+    mock_return(invocation, g_variant_new("(ao)", &results));
+}
+
+// Replace updates an item with the same attributes in place
+static void handle_create_item(GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+    GVariant* properties;
+    GVariant* secret;
+    gboolean replace;
+    gchar* content_type = NULL;
+    const gchar* label  = "";
+
+    if(mock_locked)
+    {
+        mock_return_error(invocation, IS_LOCKED_ERROR, "Collection is locked");
+        return;
+    }
+
+    g_variant_get(parameters, "(@a{sv}@(oayays)b)", &properties, &secret, &replace);
+    GBytes* bytes = parse_secret(secret, &content_type);
+    g_variant_unref(secret);
+
+    if(bytes == NULL)
+    {
+        g_variant_unref(properties);
+        mock_return_error(invocation, NO_SESSION_ERROR, "No such session");
+        return;
+    }
+
+    g_variant_lookup(properties, ITEM_INTERFACE ".Label", "&s", &label);
+    GVariant* attributes    = g_variant_lookup_value(properties, ITEM_INTERFACE ".Attributes", G_VARIANT_TYPE("a{ss}"));
+    GHashTable* table       = attributes_new(attributes);
+    MockItem* item          = replace ? find_item(table) : NULL;
+
+    if(item != NULL)
+    {
+        g_free(item->label);
+        g_bytes_unref(item->secret);
+        g_free(item->content_type);
+        item->label         = g_strdup(label);
+        item->secret        = bytes;
+        item->content_type  = content_type;
+        item->modified      = now();
+        g_hash_table_destroy(table);
+        emit_item_signal("ItemChanged", item->path);
+    }
+    else
+    {
+        item = create_item(label, table, bytes, content_type);
+    }
+
+    if(attributes != NULL) g_variant_unref(attributes);
+    g_variant_unref(properties);
+
+    mock_return(invocation, g_variant_new("(oo)", item->path, NO_PROMPT));
+}
+
+static void on_collection_method_call(GDBusConnection* connection,
+                    const gchar* sender,
+                    const gchar* object_path,
+                    const gchar* interface_name,
+                    const gchar* method_name,
+                    GVariant* parameters,
+                    GDBusMethodInvocation* invocation,
+                    gpointer user_data)
+{
+    count_call(interface_name, method_name);
+
+    if(g_strcmp0(method_name, "SearchItems") == 0)          handle_collection_search(parameters, invocation);
+    else if(g_strcmp0(method_name, "CreateItem") == 0)      handle_create_item(parameters, invocation);
+    else mock_return_error(invocation, NOT_SUPPORTED_ERROR, "Not supported by the mock keyring");
+}
+
+static GVariant* on_collection_get_property(GDBusConnection* connection,
+                    const gchar* sender,
+                    const gchar* object_path,
+                    const gchar* interface_name,
+                    const gchar* property_name,
+                    GError** error,
+                    gpointer user_data)
+{
+    if(g_strcmp0(property_name, "Items") == 0)
+    {
+        GVariantBuilder items;
+        GHashTableIter iter;
+        gpointer path;
+
+        g_variant_builder_init(&items, G_VARIANT_TYPE("ao"));
+        g_hash_table_iter_init(&iter, mock_items);
+        while(g_hash_table_iter_next(&iter, &path, NULL))
+            g_variant_builder_add(&items, "o", path);
+
+        return g_variant_builder_end(&items);
+    }
+
+    if(g_strcmp0(property_name, "Label") == 0)      return g_variant_new_string("Login");
+    if(g_strcmp0(property_name, "Locked") == 0)     return g_variant_new_boolean(mock_locked);
+    if(g_strcmp0(property_name, "Created") == 0)    return g_variant_new_uint64(mock_created);
+    if(g_strcmp0(property_name, "Modified") == 0)   return g_variant_new_uint64(mock_created);
+    return NULL;
+}
+
+// Label changes are accepted and dropped
+static gboolean on_collection_set_property(GDBusConnection* connection,
+                    const gchar* sender,
+                    const gchar* object_path,
+                    const gchar* interface_name,
+                    const gchar* property_name,
+                    GVariant* value,
+                    GError** error,
+                    gpointer user_data)
+{
+    return TRUE;
+}
+
+static const GDBusInterfaceVTable collection_vtable = {on_collection_method_call, on_collection_get_property, on_collection_set_property, {NULL}};
+
+/**************************************************
+ **************************************************
+ ******************* Item object ******************
+ **************************************************
+ **************************************************/
+
+static void handle_get_secret(MockItem* item, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+    const gchar* session;
+    g_variant_get(parameters, "(&o)", &session);
+
+    if(!session_valid(session))
+        mock_return_error(invocation, NO_SESSION_ERROR, "No such session");
+    else if(mock_locked)
+        mock_return_error(invocation, IS_LOCKED_ERROR, "Item is locked");
+    else
+        mock_return(invocation, g_variant_new("(@(oayays))", item_secret(item, session)));
+}
+
+static void handle_set_secret(MockItem* item, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+    GVariant* secret;
+    gchar* content_type = NULL;
+
+    if(mock_locked)
+    {
+        mock_return_error(invocation, IS_LOCKED_ERROR, "Item is locked");
+        return;
+    }
+
+    g_variant_get(parameters, "(@(oayays))", &secret);
+    GBytes* bytes = parse_secret(secret, &content_type);
+    g_variant_unref(secret);
+
+    if(bytes == NULL)
+    {
+        mock_return_error(invocation, NO_SESSION_ERROR, "No such session");
+        return;
+    }
+
+    g_bytes_unref(item->secret);
+    g_free(item->content_type);
+    item->secret        = bytes;
+    item->content_type  = content_type;
+    item->modified      = now();
+    emit_item_signal("ItemChanged", item->path);
+
+    mock_return(invocation, NULL);
+}
+
+static void on_item_method_call(GDBusConnection* connection,
+                    const gchar* sender,
+                    const gchar* object_path,
+                    const gchar* interface_name,
+                    const gchar* method_name,
+                    GVariant* parameters,
+                    GDBusMethodInvocation* invocation,
+                    gpointer user_data)
+{
+    MockItem* item = (MockItem*) user_data;
+    count_call(interface_name, method_name);
+
+    if(g_strcmp0(method_name, "Delete") == 0)
+    {
+        delete_item(item);
+        mock_return(invocation, g_variant_new("(o)", NO_PROMPT));
+    }
+    else if(g_strcmp0(method_name, "GetSecret") == 0)      handle_get_secret(item, parameters, invocation);
+    else if(g_strcmp0(method_name, "SetSecret") == 0)      handle_set_secret(item, parameters, invocation);
+    else mock_return_error(invocation, NOT_SUPPORTED_ERROR, "Not supported by the mock keyring");
+}
+
+static GVariant* on_item_get_property(GDBusConnection* connection,
+                    const gchar* sender,
+                    const gchar* object_path,
+                    const gchar* interface_name,
+                    const gchar* property_name,
+                    GError** error,
+                    gpointer user_data)
+{
+    MockItem* item = (MockItem*) user_data;
+
+    if(g_strcmp0(property_name, "Locked") == 0)     return g_variant_new_boolean(mock_locked);
+    if(g_strcmp0(property_name, "Attributes") == 0) return attributes_variant(item->attributes);
+    if(g_strcmp0(property_name, "Label") == 0)      return g_variant_new_string(item->label);
+    if(g_strcmp0(property_name, "Created") == 0)    return g_variant_new_uint64(item->created);
+    if(g_strcmp0(property_name, "Modified") == 0)   return g_variant_new_uint64(item->modified);
+    return NULL;
+}
+
+static gboolean on_item_set_property(GDBusConnection* connection,
+                    const gchar* sender,
+                    const gchar* object_path,
+                    const gchar* interface_name,
+                    const gchar* property_name,
+                    GVariant* value,
+                    GError** error,
+                    gpointer user_data)
+{
+    MockItem* item = (MockItem*) user_data;
+    count_call(interface_name, property_name);
+
+    if(mock_locked)
+    {
+        g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_ACCESS_DENIED, "Item is locked");
+        return FALSE;
+    }
+
+    if(g_strcmp0(property_name, "Attributes") == 0)
+    {
+        g_hash_table_destroy(item->attributes);
+        item->attributes = attributes_new(value);
+    }
+    else if(g_strcmp0(property_name, "Label") == 0)
+    {
+        g_free(item->label);
+        item->label = g_variant_dup_string(value, NULL);
+    }
+
+    item->modified = now();
+    emit_item_signal("ItemChanged", item->path);
+
+    return TRUE;
+}
+
+static const GDBusInterfaceVTable item_vtable = {on_item_method_call, on_item_get_property, on_item_set_property, {NULL}};
+
+/**************************************************
+ **************************************************
+ ******************* Sessions *********************
+ **************************************************
+ **************************************************/
+
+static void on_session_method_call(GDBusConnection* connection,
+                    const gchar* sender,
+                    const gchar* object_path,
+                    const gchar* interface_name,
+                    const gchar* method_name,
+                    GVariant* parameters,
+                    GDBusMethodInvocation* invocation,
+                    gpointer user_data)
+{
+    count_call(interface_name, method_name);
+
+    guint registration = GPOINTER_TO_UINT(g_hash_table_lookup(mock_sessions, object_path));
+    g_dbus_connection_unregister_object(connection, registration);
+    g_hash_table_remove(mock_sessions, object_path);
+
+    mock_return(invocation, NULL);
+}
+
+static const GDBusInterfaceVTable session_vtable = {on_session_method_call, NULL, NULL, {NULL}};
+
+/**************************************************
+ **************************************************
+ ********************* Main ***********************
+ **************************************************
+ **************************************************/
+
+// Objects are in place before the name is owned, so no client races them
+static void on_bus_acquired(GDBusConnection* connection, const gchar* name, gpointer user_data)
+{
+    mock_connection = connection;
+
+    g_dbus_connection_register_object(connection, SERVICE_PATH, interface_info(SERVICE_INTERFACE), &service_vtable, NULL, NULL, NULL);
+    g_dbus_connection_register_object(connection, COLLECTION_PATH, interface_info(COLLECTION_INTERFACE), &collection_vtable, NULL, NULL, NULL);
+}
+
+static void on_name_acquired(GDBusConnection* connection, const gchar* name, gpointer user_data)
+{
+    g_message("Serving %s%s", name, mock_locked ? ", locked" : "");
+}
+
+// Also called when the private bus goes away
+static void on_name_lost(GDBusConnection* connection, const gchar* name, gpointer user_data)
+{
+    if(connection != NULL) g_warning("Could not own %s, is another keyring running on this bus?", name);
+    g_main_loop_quit(mock_loop);
+}
+
+static gboolean on_quit_signal(gpointer user_data)
+{
+    g_main_loop_quit(mock_loop);
+    return G_SOURCE_CONTINUE;
+}
+
+static gint compare_calls(gconstpointer a, gconstpointer b)
+{
+    return g_strcmp0(*(const gchar**) a, *(const gchar**) b);
+}
+
+static void report_calls()
+{
+    GHashTableIter iter;
+    gpointer key, count;
+    GPtrArray* names = g_ptr_array_new();
+
+    g_hash_table_iter_init(&iter, mock_calls);
+    while(g_hash_table_iter_next(&iter, &key, &count))
+        g_ptr_array_add(names, key);
+
+    g_ptr_array_sort(names, compare_calls);
+
+    g_print("Mock keyring: %u items left, calls by method:\n", g_hash_table_size(mock_items));
+    for(guint i = 0; i < names->len; i++)
+        g_print("%10u  %s\n", GPOINTER_TO_UINT(g_hash_table_lookup(mock_calls, names->pdata[i])), (gchar*) names->pdata[i]);
+
+    g_ptr_array_free(names, TRUE);
+}
+
+int main(int argc, char** argv)
+{
+    GError* error = NULL;
+
+    GOptionEntry entries[] = {
+        { "locked", 0, 0, G_OPTION_ARG_NONE, &mock_locked, "Start with a locked collection", NULL },
+        { "delay", 0, 0, G_OPTION_ARG_INT, &mock_delay, "Answer every method call after MS milliseconds", "MS" },
+        { NULL }
+    };
+
+    GOptionContext* context = g_option_context_new("- in-memory org.freedesktop.secrets for the stress target");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if(!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    mock_loop           = g_main_loop_new(NULL, FALSE);
+    mock_introspection  = g_dbus_node_info_new_for_xml(mock_introspection_xml, NULL);
+    mock_items          = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, mock_item_free);
+    mock_sessions       = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    mock_calls          = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    mock_created        = now();
+
+    guint owner = g_bus_own_name(G_BUS_TYPE_SESSION, SECRETS_BUS_NAME, G_BUS_NAME_OWNER_FLAGS_NONE, on_bus_acquired, on_name_acquired, on_name_lost, NULL, NULL);
+
+    g_unix_signal_add(SIGINT, on_quit_signal, NULL);
+    g_unix_signal_add(SIGTERM, on_quit_signal, NULL);
+    g_main_loop_run(mock_loop);
+
+    report_calls();
+
+    g_bus_unown_name(owner);
+    g_hash_table_destroy(mock_calls);
+    g_hash_table_destroy(mock_sessions);
+    g_hash_table_destroy(mock_items);
+    g_dbus_node_info_unref(mock_introspection);
+    g_main_loop_unref(mock_loop);
+
+    return 0;
+}
@@ -0,0 +1,488 @@
+// Stress driver for purple-gnome-keyring
+//
+// Runs libpurple headless with a null UI, loads the plugin and fires
+// randomized account signal storms at it, so async keyring callbacks
+// overlap with accounts being changed, renamed and freed. Meant to run
+// under ASan against the mock keyring, see the stress rule of the Makefile.
+//
+// Usage: stress-driver --plugin PATH [--accounts N] [--ops N] [--seed N] [--debug]
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <string.h>
+
+#include "account.h"
+#include "blist.h"
+#include "connection.h"
+#include "core.h"
+#include "debug.h"
+#include "eventloop.h"
+#include "plugin.h"
+#include "prefs.h"
+#include "signals.h"
+#include "util.h"
+
+#define STRESS_UI           "purple-gnome-keyring-stress"
+#define STRESS_PROTOCOL     "prpl-stress"
+#define SECRETS_BUS_NAME    "org.freedesktop.secrets"
+
+// Prefs of the plugin
+#define PLUG_STATUS_PREF    "/plugins/core/purple_gnome_keyring/plug_status"
+#define AUTO_SAVE_PREF      "/plugins/core/purple_gnome_keyring/auto_save"
+#define PROFILE_PREF        "/plugins/core/purple_gnome_keyring/profile_startup"
+#define PLUG_STATUS_LOADED  1
+
+// Events are dispatched after every op with this chance, so several ops overlap
+#define DISPATCH_CHANCE     8
+// Drained once the keyring stayed quiet this long
+#define DRAIN_QUIET         (500 * 1000)
+#define DRAIN_TIMEOUT       (120 * G_USEC_PER_SEC)
+
+// Weighted storm operations
+typedef enum {
+    OP_ADD,
+    OP_REMOVE,
+    OP_TOGGLE,
+    OP_PASSWORD,
+    OP_CONNECTING,
+    OP_SIGNED_ON,
+    OP_NETWORK_ERROR,
+    OP_AUTH_ERROR,
+    OP_RENAME,
+    OP_COUNT
+} storm_op;
+
+static const guint op_weights[OP_COUNT]     = {5, 5, 15, 15, 15, 15, 10, 5, 15};
+static const gchar* op_names[OP_COUNT]      = {"add", "remove", "toggle", "password", "connecting", "signed-on", "network-error", "auth-error", "rename"};
+
+GRand* stress_rand              = NULL;
+GPtrArray* stress_accounts      = NULL;     // Live accounts
+guint stress_next_account       = 0;
+guint stress_op_counts[OP_COUNT];
+
+/**************************************************
+ **************************************************
+ ************* Null UI, glib eventloop ************
+ **************************************************
+ **************************************************/
+
+// Same as libpurple's nullclient example
+
+#define PURPLE_GLIB_READ_COND  (G_IO_IN | G_IO_HUP | G_IO_ERR)
+#define PURPLE_GLIB_WRITE_COND (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
+
+typedef struct {
+    PurpleInputFunction function;
+    guint result;
+    gpointer data;
+} PurpleGLibIOClosure;
+
+static gboolean purple_glib_io_invoke(GIOChannel* source, GIOCondition condition, gpointer data)
+{
+    PurpleGLibIOClosure* closure    = data;
+    PurpleInputCondition purple_cond = 0;
+
+    if(condition & PURPLE_GLIB_READ_COND) purple_cond |= PURPLE_INPUT_READ;
+    if(condition & PURPLE_GLIB_WRITE_COND) purple_cond |= PURPLE_INPUT_WRITE;
+
+    closure->function(closure->data, g_io_channel_unix_get_fd(source), purple_cond);
+    return TRUE;
+}
+
+static guint glib_input_add(gint fd, PurpleInputCondition condition, PurpleInputFunction function, gpointer data)
+{
+    PurpleGLibIOClosure* closure    = g_new0(PurpleGLibIOClosure, 1);
+    GIOCondition cond               = 0;
+    closure->function               = function;
+    closure->data                   = data;
+
+    if(condition & PURPLE_INPUT_READ) cond |= PURPLE_GLIB_READ_COND;
+    if(condition & PURPLE_INPUT_WRITE) cond |= PURPLE_GLIB_WRITE_COND;
+
+    GIOChannel* channel = g_io_channel_unix_new(fd);
+    closure->result     = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond, purple_glib_io_invoke, closure, g_free);
+    g_io_channel_unref(channel);
+
+    return closure->result;
+}
+
+static PurpleEventLoopUiOps glib_eventloops = {
+    g_timeout_add,
+    g_source_remove,
+    glib_input_add,
+    g_source_remove,
+    NULL,
+    g_timeout_add_seconds,
+    NULL,
+    NULL,
+    NULL
+};
+
+static PurpleCoreUiOps core_uiops = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+
+/**************************************************
+ **************************************************
+ ******************* Helpers **********************
+ **************************************************
+ **************************************************/
+
+// The mock keyring is started next to the driver, give it time to own its name
+static gboolean wait_for_keyring()
+{
+    GError* error           = NULL;
+    gboolean owned          = FALSE;
+    GDBusConnection* bus    = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+
+    if(error != NULL)
+    {
+        g_printerr("No session bus: %s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    for(guint i = 0; (i < 100) && (!owned); i++)
+    {
+        GVariant* reply = g_dbus_connection_call_sync(bus,
+                "org.freedesktop.DBus",
+                "/org/freedesktop/DBus",
+                "org.freedesktop.DBus",
+                "NameHasOwner",
+                g_variant_new("(s)", SECRETS_BUS_NAME),
+                G_VARIANT_TYPE("(b)"),
+                G_DBUS_CALL_FLAGS_NONE,
+                -1,
+                NULL,
+                NULL);
+
+        if(reply != NULL)
+        {
+            g_variant_get(reply, "(b)", &owned);
+            g_variant_unref(reply);
+        }
+
+        if(!owned) g_usleep(100 * 1000);
+    }
+
+    g_object_unref(bus);
+
+    if(!owned) g_printerr("%s did not show up on the session bus\n", SECRETS_BUS_NAME);
+    return owned;
+}
+
+// Dispatch what is ready without blocking
+static void dispatch_pending()
+{
+    for(guint i = 0; (i < 64) && g_main_context_iteration(NULL, FALSE); i++);
+}
+
+// Run until the keyring went quiet, TRUE if it did in time
+static gboolean drain()
+{
+    gint64 started  = g_get_monotonic_time();
+    gint64 active   = started;
+
+    while(g_get_monotonic_time() - active < DRAIN_QUIET)
+    {
+        if(g_get_monotonic_time() - started > DRAIN_TIMEOUT) return FALSE;
+
+        if(g_main_context_iteration(NULL, FALSE)) active = g_get_monotonic_time();
+        else g_usleep(1000);
+    }
+
+    return TRUE;
+}
+
+static void report_phase(const gchar* name, guint ops, gint64 started)
+{
+    gdouble seconds = (g_get_monotonic_time() - started) / (gdouble) G_USEC_PER_SEC;
+    g_print("%-10s %8u ops %9.3f s %10.1f ops/s\n", name, ops, seconds, (seconds > 0) ? ops / seconds : 0);
+}
+
+static void remove_tree(const gchar* path)
+{
+    GDir* dir = g_dir_open(path, 0, NULL);
+    const gchar* name;
+
+    while((dir != NULL) && ((name = g_dir_read_name(dir)) != NULL))
+    {
+        gchar* child = g_build_filename(path, name, NULL);
+
+        if(g_file_test(child, G_FILE_TEST_IS_DIR) && !g_file_test(child, G_FILE_TEST_IS_SYMLINK)) remove_tree(child);
+        else g_unlink(child);
+
+        g_free(child);
+    }
+
+    if(dir != NULL) g_dir_close(dir);
+    g_rmdir(path);
+}
+
+/**************************************************
+ **************************************************
+ ******************* Accounts *********************
+ **************************************************
+ **************************************************/
+
+static gchar* random_password()
+{
+    return g_strdup_printf("stress-%08x", g_rand_int(stress_rand));
+}
+
+static gchar* next_username()
+{
+    return g_strdup_printf("stress%u@example.org", stress_next_account++);
+}
+
+static PurpleAccount* random_account()
+{
+    if(stress_accounts->len == 0) return NULL;
+    return g_ptr_array_index(stress_accounts, g_rand_int_range(stress_rand, 0, stress_accounts->len));
+}
+
+// account-added stores the password
+static void add_account()
+{
+    gchar* username         = next_username();
+    gchar* password         = random_password();
+    PurpleAccount* account  = purple_account_new(username, STRESS_PROTOCOL);
+
+    purple_account_set_remember_password(account, TRUE);
+    purple_account_set_password(account, password);
+    purple_accounts_add(account);
+    purple_account_set_enabled(account, STRESS_UI, TRUE);
+    g_ptr_array_add(stress_accounts, account);
+
+    g_free(username);
+    g_free(password);
+}
+
+// account-removed deletes the password, then the account is freed
+static void remove_account(PurpleAccount* account)
+{
+    g_ptr_array_remove_fast(stress_accounts, account);
+    purple_accounts_delete(account);
+}
+
+static void emit_connection_error(PurpleAccount* account, PurpleConnectionError error)
+{
+    purple_signal_emit(purple_accounts_get_handle(), "account-connection-error", account, error, "stress");
+}
+
+static void run_op(storm_op op)
+{
+    PurpleAccount* account = random_account();
+    void* handle = purple_accounts_get_handle();
+
+    if((account == NULL) && (op != OP_ADD)) op = OP_ADD;
+    stress_op_counts[op]++;
+
+    switch(op)
+    {
+        case OP_ADD:
+            add_account();
+            break;
+
+        case OP_REMOVE:
+            remove_account(account);
+            break;
+
+        case OP_TOGGLE:
+            purple_account_set_enabled(account, STRESS_UI, !purple_account_get_enabled(account, STRESS_UI));
+            break;
+
+        case OP_PASSWORD:
+        {
+            gchar* password = random_password();
+            purple_account_set_password(account, password);
+            purple_signal_emit(handle, "account-connecting", account);
+            g_free(password);
+            break;
+        }
+
+        case OP_CONNECTING:
+            purple_signal_emit(handle, "account-connecting", account);
+            break;
+
+        case OP_SIGNED_ON:
+            purple_signal_emit(handle, "account-signed-on", account);
+            break;
+
+        case OP_NETWORK_ERROR:
+            emit_connection_error(account, PURPLE_CONNECTION_ERROR_NETWORK_ERROR);
+            break;
+
+        case OP_AUTH_ERROR:
+            emit_connection_error(account, PURPLE_CONNECTION_ERROR_AUTHENTICATION_FAILED);
+            break;
+
+        case OP_RENAME:
+        {
+            gchar* username = next_username();
+            purple_account_set_username(account, username);
+            purple_signal_emit(handle, "account-connecting", account);
+            g_free(username);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+static storm_op random_op()
+{
+    guint total = 0;
+    for(guint i = 0; i < OP_COUNT; i++) total += op_weights[i];
+
+    guint pick = g_rand_int_range(stress_rand, 0, total);
+    for(guint i = 0; i < OP_COUNT; i++)
+    {
+        if(pick < op_weights[i]) return i;
+        pick -= op_weights[i];
+    }
+
+    return OP_CONNECTING;
+}
+
+static void maybe_dispatch()
+{
+    if(g_rand_int_range(stress_rand, 0, DISPATCH_CHANCE) == 0) dispatch_pending();
+}
+
+/**************************************************
+ **************************************************
+ ********************* Main ***********************
+ **************************************************
+ **************************************************/
+
+int main(int argc, char** argv)
+{
+    gchar* path         = NULL;
+    gint accounts       = 2000;
+    gint ops            = 20000;
+    gint seed           = 0;
+    gboolean debug      = FALSE;
+    gboolean drained    = TRUE;
+    GError* error       = NULL;
+    gint64 started;
+
+    GOptionEntry entries[] = {
+        { "plugin", 0, 0, G_OPTION_ARG_FILENAME, &path, "Plugin to stress", "PATH" },
+        { "accounts", 0, 0, G_OPTION_ARG_INT, &accounts, "Accounts created before the storm, default 2000", "N" },
+        { "ops", 0, 0, G_OPTION_ARG_INT, &ops, "Storm operations, default 20000", "N" },
+        { "seed", 0, 0, G_OPTION_ARG_INT, &seed, "Seed of the storm, random by default", "N" },
+        { "debug", 0, 0, G_OPTION_ARG_NONE, &debug, "Print the libpurple debug log, including the startup profile", NULL },
+        { NULL }
+    };
+
+    GOptionContext* context = g_option_context_new("- account signal storms against purple-gnome-keyring");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if(!g_option_context_parse(context, &argc, &argv, &error) || (path == NULL))
+    {
+        g_printerr("%s\n", (error != NULL) ? error->message : "--plugin is required");
+        g_clear_error(&error);
+        g_option_context_free(context);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    if(seed == 0) seed = g_random_int_range(1, G_MAXINT);
+    stress_rand     = g_rand_new_with_seed(seed);
+    stress_accounts = g_ptr_array_new();
+    g_print("Seed %d, %d accounts, %d ops\n", seed, accounts, ops);
+
+    // Throwaway libpurple profile
+    gchar* user_dir = g_dir_make_tmp("purple-gnome-keyring-stress-XXXXXX", &error);
+    if(error != NULL)
+    {
+        g_printerr("Could not create a profile: %s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    purple_util_set_user_dir(user_dir);
+    purple_debug_set_enabled(debug);
+    purple_core_set_ui_ops(&core_uiops);
+    purple_eventloop_set_ui_ops(&glib_eventloops);
+
+    if(!purple_core_init(STRESS_UI) || !wait_for_keyring())
+    {
+        remove_tree(user_dir);
+        g_free(user_dir);
+        return 1;
+    }
+
+    purple_set_blist(purple_blist_new());
+
+    PurplePlugin* plugin = purple_plugin_probe(path);
+    if(plugin == NULL)
+    {
+        g_printerr("Could not probe %s\n", path);
+        purple_core_quit();
+        remove_tree(user_dir);
+        g_free(user_dir);
+        return 1;
+    }
+
+    // Skip the first run question, follow added and removed accounts
+    purple_prefs_set_int(PLUG_STATUS_PREF, PLUG_STATUS_LOADED);
+    purple_prefs_set_bool(AUTO_SAVE_PREF, TRUE);
+    purple_prefs_set_bool(PROFILE_PREF, debug);
+
+    started = g_get_monotonic_time();
+    purple_plugin_load(plugin);
+    report_phase("load", 1, started);
+
+    // Populate
+    started = g_get_monotonic_time();
+    for(gint i = 0; i < accounts; i++)
+    {
+        add_account();
+        maybe_dispatch();
+    }
+    drained &= drain();
+    report_phase("populate", accounts, started);
+
+    // Startup over all accounts
+    purple_plugin_unload(plugin);
+    purple_prefs_set_int(PLUG_STATUS_PREF, PLUG_STATUS_LOADED);
+
+    started = g_get_monotonic_time();
+    purple_plugin_load(plugin);
+    report_phase("reload", stress_accounts->len, started);
+    drained &= drain();
+
+    // Storm
+    memset(stress_op_counts, 0, sizeof(stress_op_counts));
+    started = g_get_monotonic_time();
+    for(gint i = 0; i < ops; i++)
+    {
+        run_op(random_op());
+        maybe_dispatch();
+    }
+    report_phase("storm", ops, started);
+
+    started = g_get_monotonic_time();
+    drained &= drain();
+    report_phase("drain", 0, started);
+
+    for(guint i = 0; i < OP_COUNT; i++)
+        g_print("%10u  %s\n", stress_op_counts[i], op_names[i]);
+    g_print("%u accounts left\n", stress_accounts->len);
+
+    if(!drained) g_printerr("Keyring traffic did not settle within %d s\n", (gint) (DRAIN_TIMEOUT / G_USEC_PER_SEC));
+
+    // Unloads the plugin through the quitting path
+    purple_core_quit();
+
+    remove_tree(user_dir);
+    g_free(user_dir);
+    g_free(path);
+    g_ptr_array_free(stress_accounts, TRUE);
+    g_rand_free(stress_rand);
+
+    return drained ? 0 : 1;
+}